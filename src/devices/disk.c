@@ -86,7 +86,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sectors (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -218,46 +218,96 @@ disk_size (struct disk *d)
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) 
+{
+  ASSERT (buffer != NULL);
+
+  disk_read_multiple (d, sec_no, &buffer, 1);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   DISK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
+{
+  ASSERT (buffer != NULL);
+
+  disk_write_multiple (d, sec_no, &buffer, 1);
+}
+
+/* Reads the CNT consecutive sectors starting at SEC_NO from disk
+   D, scattering sector SEC_NO + I into BUFFERS[I], which must have
+   room for DISK_SECTOR_SIZE bytes.
+   Each command transfers up to DISK_MULTIPLE_MAX sectors, so a
+   run costs one command instead of one per sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no, void *buffers[],
+                    size_t cnt) 
 {
   struct channel *c;
+  size_t i;
   
   ASSERT (d != NULL);
-  ASSERT (buffer != NULL);
+  ASSERT (buffers != NULL);
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  d->read_cnt++;
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % DISK_MULTIPLE_MAX == 0)
+        {
+          select_sectors (d, sec_no + i, cnt - i);
+          issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+        }
+
+      /* The disk interrupts once each sector is ready. */
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no + i);
+      input_sector (c, buffers[i]);
+    }
+  d->read_cnt += cnt;
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
+/* Writes the CNT consecutive sectors starting at SEC_NO to disk D,
+   gathering sector SEC_NO + I from BUFFERS[I], which must contain
    DISK_SECTOR_SIZE bytes.  Returns after the disk has
    acknowledged receiving the data.
+   Each command transfers up to DISK_MULTIPLE_MAX sectors.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 void
-disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
+disk_write_multiple (struct disk *d, disk_sector_t sec_no,
+                     const void *const buffers[], size_t cnt)
 {
   struct channel *c;
+  size_t i;
   
   ASSERT (d != NULL);
-  ASSERT (buffer != NULL);
+  ASSERT (buffers != NULL);
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  d->write_cnt++;
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % DISK_MULTIPLE_MAX == 0)
+        {
+          select_sectors (d, sec_no + i, cnt - i);
+          issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+        }
+
+      /* The disk interrupts once each sector is written. */
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      output_sector (c, buffers[i]);
+      sema_down (&c->completion_wait);
+    }
+  d->write_cnt += cnt;
   lock_release (&c->lock);
 }
 
@@ -426,18 +476,23 @@ print_ata_string (char *string, size_t size)
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO to the disk's sector selection registers and the
+   number of sectors to transfer, CNT but at most DISK_MULTIPLE_MAX,
+   to its sector count register.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) 
+select_sectors (struct disk *d, disk_sector_t sec_no, size_t cnt) 
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < d->capacity);
-  ASSERT (sec_no < (1UL << 28));
+  if (cnt > DISK_MULTIPLE_MAX)
+    cnt = DISK_MULTIPLE_MAX;
+
+  ASSERT (cnt > 0);
+  ASSERT (sec_no + cnt <= d->capacity);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt % DISK_MULTIPLE_MAX);      /* 0 means 256. */
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -12,6 +12,10 @@
 #include <stdio.h>
 #include <string.h>
 
+/* Directory entries read per getdents() call. */
+#define ENTRY_CNT 512
+static struct dirent entries[ENTRY_CNT];
+
 static bool
 list_dir (const char *dir, bool verbose) 
 {
@@ -24,38 +28,43 @@ list_dir (const char *dir, bool verbose)
 
   if (isdir (dir_fd))
     {
-      char name[READDIR_MAX_LEN];
+      int cnt;
 
       printf ("%s", dir);
       if (verbose)
         printf (" (inumber %d)", inumber (dir_fd));
       printf (":\n");
 
-      while (readdir (dir_fd, name)) 
+      while ((cnt = getdents (dir_fd, entries, ENTRY_CNT)) > 0) 
         {
-          printf ("%s", name); 
-          if (verbose) 
-            {
-              char full_name[128];
-              int entry_fd;
+          int i;
 
-              snprintf (full_name, sizeof full_name, "%s/%s", dir, name);
-              entry_fd = open (full_name);
+          for (i = 0; i < cnt; i++) 
+            {
+              const struct dirent *e = &entries[i];
 
-              printf (": ");
-              if (entry_fd != -1)
+              printf ("%s", e->name); 
+              if (verbose && e->is_dir)
+                printf (": directory, inumber %d", e->inumber);
+              else if (verbose) 
                 {
-                  if (isdir (entry_fd))
-                    printf ("directory");
-                  else
+                  char full_name[128];
+                  int entry_fd;
+
+                  snprintf (full_name, sizeof full_name, "%s/%s",
+                            dir, e->name);
+                  entry_fd = open (full_name);
+
+                  printf (": ");
+                  if (entry_fd != -1)
                     printf ("%d-byte file", filesize (entry_fd));
-                  printf (", inumber %d", inumber (entry_fd));
+                  else
+                    printf ("open failed");
+                  printf (", inumber %d", e->inumber);
+                  close (entry_fd);
                 }
-              else
-                printf ("open failed");
-              close (entry_fd);
+              printf ("\n");
             }
-          printf ("\n");
         }
     }
   else 
@@ -1,275 +1,759 @@
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
 #include <string.h>
 #include <debug.h>
+#include <hash.h>
+#include <round.h>
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include "devices/timer.h"
 
-#define BUF_WRITE_TICKS 100
+#define BUF_WRITE_TICKS 100		/* period of the write behind thread */
+#define BUF_DIRTY_AGE 100		/* ticks a cache may stay dirty */
+#define BUF_DIRTY_HIGH 50		/* % of dirty caches which forces a flush */
+#define READ_AHEAD_QUEUE_SIZE 64	/* read ahead requests queued at most */
+
+/* state of a cache */
+enum cache_state
+{
+    CACHE_FREE,				/* not bound to any sector */
+    CACHE_LOADING,			/* contents are being filled in */
+    CACHE_VALID,			/* contents are valid */
+    CACHE_WRITEBACK			/* contents are being written to a disk */
+};
+
+/* how cache_pin () is going to use a cache */
+enum cache_mode
+{
+    CACHE_READ,				/* read a part of a sector */
+    CACHE_WRITE,			/* overwrite a part of a sector */
+    CACHE_OVERWRITE,			/* overwrite a whole sector */
+    CACHE_PREFETCH			/* read ahead, not counted as an access */
+};
 
 struct cache{
     disk_sector_t pos;
-    char data[DISK_SECTOR_SIZE];
+    uint8_t *data;			/* DISK_SECTOR_SIZE bytes in cache_pages */
 
+    enum cache_state state;
+    int pin_cnt;			/* number of users, never evicted while > 0 */
     bool dirty;
+    int64_t dirty_since;		/* timer tick when it became dirty */
     bool accessed;
-    struct lock cache_lock;
+    bool prefetched;			/* loaded by read ahead, not accessed yet */
+    bool miss_pending;			/* loaded by cache_load_run () for a reader
+					   which has not pinned it yet */
+    struct lock cache_lock;		/* protects data while it is copied */
+    struct condition io_done;		/* signaled when LOADING or WRITEBACK ends */
+    struct hash_elem hash_elem;		/* element in cache_hash, indexed by pos */
 };
 
-struct read_ahead{
-    disk_sector_t pos;
-    struct list_elem read_ahead_elem;
-};
+size_t buf_cache_size = BUF_CACHE_SIZE;
 
-static struct cache cache_arr[BUF_CACHE_SIZE];
-static int cache_num = 0; 
+/* cache_lock protects the cache list, cache_hash, clock_hand and every
+ * field of a cache but its data.  it is never held during a disk I/O, a
+ * thread which needs a cache being loaded or written back waits on the
+ * io_done condition of that cache instead. */
+static struct cache *cache_arr;		/* buf_cache_size caches */
+static uint8_t *cache_pages;		/* sector buffers of the caches */
+static size_t cache_num = 0;
 static struct lock cache_lock;
+static struct hash cache_hash;		/* sector number -> cache_arr entry */
+static cache_id clock_hand;		/* next cache examined by evict_cache () */
+static struct condition cache_released;	/* signaled when a cache may be evicted */
+static size_t dirty_cnt;		/* number of dirty caches */
+static struct lock flush_lock;		/* one cache_flush () at a time */
+static struct cache **flush_batch;	/* caches written by cache_flush () */
+static const void **flush_data;		/* their data, a run at a time */
+static struct cache_stat stats;		/* protected by cache_lock */
 static struct lock read_ahead_lock;
 static disk_sector_t disk_length;
-static struct list read_ahead_list;
 static struct condition read_ahead_cond;
 
+/* ring buffer of sectors to read ahead, protected by read_ahead_lock */
+static disk_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;		/* index of the oldest request */
+static size_t read_ahead_cnt;		/* number of queued requests */
+
 
-static cache_id evict_cache (void);
-static void cache_clear (cache_id);
+static struct cache *cache_pin (disk_sector_t, enum cache_mode);
+static void cache_unpin (struct cache *, bool dirty);
+static struct cache *evict_cache (bool wait);
+static void cache_lock_acquire (void);
+static void cache_write_back (struct cache *);
+static void cache_flush (int64_t min_age);
+static int cache_pos_compare (const void *, const void *);
 static void periodic_write (void* aux UNUSED);
+static void cache_install (struct cache *, disk_sector_t);
+static void cache_drop (struct cache *);
+static unsigned cache_hash_func (const struct hash_elem *, void *aux UNUSED);
+static bool cache_less_func (const struct hash_elem *, const struct hash_elem *,
+	void *aux UNUSED);
 
 void init_cache (void)
 {
-    int iter;
-
-    lock_init (&cache_lock); 
+    size_t iter;
+    size_t page_cnt;
+
+    if (buf_cache_size < BUF_CACHE_MIN)
+	PANIC ("buffer cache must hold at least %d sectors", BUF_CACHE_MIN);
+
+    /* sector buffers are carved out of pages of the kernel pool */
+    page_cnt = DIV_ROUND_UP (buf_cache_size * DISK_SECTOR_SIZE, PGSIZE);
+    cache_pages = palloc_get_multiple (PAL_ASSERT | PAL_ZERO, page_cnt);
+    cache_arr = calloc (buf_cache_size, sizeof *cache_arr);
+    flush_batch = calloc (buf_cache_size, sizeof *flush_batch);
+    flush_data = calloc (buf_cache_size, sizeof *flush_data);
+    if (cache_arr == NULL || flush_batch == NULL || flush_data == NULL)
+	PANIC ("buffer cache allocation failed");
+
+    lock_init (&cache_lock);
+    lock_init (&flush_lock);
     lock_init (&read_ahead_lock);
-    list_init (&read_ahead_list);
     cond_init (&read_ahead_cond);
-    for (iter = 0; iter < BUF_CACHE_SIZE; iter++)
+    cond_init (&cache_released);
+    if (!hash_init (&cache_hash, cache_hash_func, cache_less_func, NULL))
+	PANIC ("buffer cache hash creation failed");
+    for (iter = 0; iter < buf_cache_size; iter++)
+    {
+	cache_arr[iter].data = cache_pages + iter * DISK_SECTOR_SIZE;
+	cache_arr[iter].state = CACHE_FREE;
 	lock_init (&cache_arr[iter].cache_lock);
+	cond_init (&cache_arr[iter].io_done);
+    }
 
-    thread_create ("read_ahead_thread", PRI_DEFAULT, thread_read_ahead, NULL); 
+    thread_create ("read_ahead_thread", PRI_DEFAULT, thread_read_ahead, NULL);
     thread_create ("periodic_write_thread", PRI_DEFAULT, periodic_write, NULL);
     disk_length = disk_size (disk_get (0, 1));
 }
 
-/* find a cache which pos is equal to the input */
+/* find a cache which pos is equal to the input
+ * (cache_lock must be held) */
 cache_id find_cache (disk_sector_t pos)
 {
-    int i;
+    struct cache key;
+    struct hash_elem *e;
+
+    key.pos = pos;
+    e = hash_find (&cache_hash, &key.hash_elem);
+    if (e == NULL)
+	return -1;
+
+    return hash_entry (e, struct cache, hash_elem) - cache_arr;
+}
+
+/* acquire cache_lock, accounting the time spent waiting for it */
+static void cache_lock_acquire (void)
+{
+    int64_t start;
+
+    if (lock_try_acquire (&cache_lock))
+	return;
+
+    start = timer_ticks ();
+    lock_acquire (&cache_lock);
+    stats.lock_waits++;
+    stats.lock_wait_ticks += timer_elapsed (start);
+}
+
+/* copy the buffer cache statistics into ST */
+void cache_get_stat (struct cache_stat *st)
+{
+    cache_lock_acquire ();
+    *st = stats;
+    lock_release (&cache_lock);
+}
+
+/* print the buffer cache statistics */
+void cache_print_stats (void)
+{
+    struct cache_stat st;
+
+    cache_get_stat (&st);
+    printf ("Buffer cache: %lld hits, %lld misses, %lld clean evictions, "
+	    "%lld dirty evictions, %lld writebacks\n",
+	    st.hits, st.misses, st.clean_evictions, st.dirty_evictions,
+	    st.writebacks);
+    printf ("Buffer cache: read ahead %lld issued, %lld used, %lld wasted\n",
+	    st.read_ahead_issued, st.read_ahead_used, st.read_ahead_wasted);
+    printf ("Buffer cache: lock waited %lld times for %lld ticks\n",
+	    st.lock_waits, st.lock_wait_ticks);
+}
+
+/* bind a free cache C to sector POS and register it in cache_hash */
+static void cache_install (struct cache *c, disk_sector_t pos)
+{
+    c->pos = pos;
+    hash_insert (&cache_hash, &c->hash_elem);
+}
+
+/* unbind a cache C which is neither pinned nor in the middle of an I/O,
+ * throwing its contents away even if it is dirty.
+ * a free cache is taken again by evict_cache ()
+ * (cache_lock must be held) */
+static void cache_drop (struct cache *c)
+{
+    ASSERT (c->pin_cnt == 0 && c->state == CACHE_VALID);
 
-    for (i = 0; i < BUF_CACHE_SIZE; i++)
+    if (c->dirty)
     {
-	if (cache_arr[i].pos == pos)
-	{
-	    return i;
-	}
+	c->dirty = false;
+	dirty_cnt--;
     }
-    return -1;
+    hash_delete (&cache_hash, &c->hash_elem);
+    c->state = CACHE_FREE;
+}
+
+/* hash function of cache_hash: a cache is hashed by its sector number */
+static unsigned cache_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+    const struct cache *c = hash_entry (e, struct cache, hash_elem);
+    return hash_int (c->pos);
+}
+
+/* comparison function of cache_hash */
+static bool cache_less_func (const struct hash_elem *a, const struct hash_elem *b,
+	void *aux UNUSED)
+{
+    return hash_entry (a, struct cache, hash_elem)->pos
+	< hash_entry (b, struct cache, hash_elem)->pos;
 }
 
 /* 1. read a disk and load into a cache list
- * 2. copy appropriate amount of cache into a buffer 
+ * 2. copy appropriate amount of cache into a buffer
  */
 void read_cache (disk_sector_t pos, void *buffer, off_t size, off_t ofs)
 {
-    /* read head */
-    lock_acquire (&read_ahead_lock);
+    struct cache *c = cache_pin (pos, CACHE_READ);
 
-    struct read_ahead *ra = malloc (sizeof (struct read_ahead));
-    ra->pos = pos + 1;
-    if (ra->pos < disk_length)
-        list_push_back (&read_ahead_list, &ra->read_ahead_elem);
-    else 
-	free (ra);
+    lock_acquire (&c->cache_lock);
+    memcpy (buffer, c->data + ofs, size);
+    lock_release (&c->cache_lock);
 
-    cond_signal (&read_ahead_cond, &read_ahead_lock);
-    
-    lock_release (&read_ahead_lock);
-      
-    /* read cache start */
-    lock_acquire (&cache_lock);
-    cache_id idx = find_cache (pos);
+    cache_unpin (c, false);
+}
 
-    /* cannot in a cache list */
-    if (idx == -1)
-    {
-	/* cache list is not full */
-	if (cache_num < BUF_CACHE_SIZE)
-	{
-	    cache_arr[cache_num].pos = pos;
-	    cache_arr[cache_num].dirty = false;
-	    disk_read (filesys_disk, pos, cache_arr[cache_num].data);
+/* 1. read a disk and load into a cache list
+ * 2. copy appropriate amount of buffer into a cache
+ */
+void write_cache (disk_sector_t pos, void *buffer, off_t size, off_t ofs)
+{
+    /* a whole sector write does not need the old contents */
+    bool partial = ofs > 0 || size < DISK_SECTOR_SIZE - ofs;
+    struct cache *c = cache_pin (pos, partial ? CACHE_WRITE : CACHE_OVERWRITE);
 
-	    memcpy (buffer, cache_arr[cache_num].data + ofs, size);
-	    cache_arr[cache_num].accessed = true;
-	    cache_num ++;
-	    lock_release (&cache_lock);
+    lock_acquire (&c->cache_lock);
+    memcpy (c->data + ofs, buffer, size);
+    lock_release (&c->cache_lock);
 
-	}
-	/* cache list is full */
-	else
-	{
-	    idx = evict_cache ();
-	    cache_arr[idx].pos = pos;
-	    cache_arr[idx].dirty = false;
-	    disk_read (filesys_disk, pos, cache_arr[idx].data);
+    cache_unpin (c, true);
+}
 
-	    memcpy (buffer, cache_arr[idx].data + ofs, size);
-	    cache_arr[idx].accessed = true;
-	    lock_release (&cache_lock);
+/* fill the cache of sector POS with zeros without reading the disk, for
+ * a sector just allocated to a file.  the zeros reach the disk only when
+ * the cache is written back, usually after the file data replaced them */
+void cache_zero (disk_sector_t pos)
+{
+    struct cache *c = cache_pin (pos, CACHE_OVERWRITE);
 
-	}
+    lock_acquire (&c->cache_lock);
+    memset (c->data, 0, DISK_SECTOR_SIZE);
+    lock_release (&c->cache_lock);
+
+    cache_unpin (c, true);
+}
+
+/* move the cached contents of delayed sector FROM over to disk sector TO,
+ * which was just allocated for them, and mark them dirty to be written
+ * back there.  a copy of TO cached from before it was freed is stale and
+ * is thrown away.
+ * the delayed sector must not be pinned */
+void cache_rename (disk_sector_t from, disk_sector_t to)
+{
+    struct cache *c;
+    cache_id idx;
+
+    ASSERT (from >= CACHE_DELAYED_BASE && to < CACHE_DELAYED_BASE);
+
+    cache_lock_acquire ();
+    while ((idx = find_cache (to)) != -1)
+    {
+	c = &cache_arr[idx];
+	if (c->pin_cnt == 0 && c->state == CACHE_VALID)
+	    cache_drop (c);
+	else
+	    cond_wait (&cache_released, &cache_lock);
     }
-    /* it is already located in a cache list */
-    else
-    {	
+
+    idx = find_cache (from);
+    if (idx == -1)
+    {
+	/* never written, so it holds zeros */
 	lock_release (&cache_lock);
-	lock_acquire (&cache_arr[idx].cache_lock);
-	memcpy (buffer, cache_arr[idx].data + ofs, size);
-	cache_arr[idx].accessed = true;
-	lock_release (&cache_arr[idx].cache_lock);
+	cache_zero (to);
+	return;
     }
+
+    c = &cache_arr[idx];
+    ASSERT (c->pin_cnt == 0 && c->state == CACHE_VALID);
+    hash_delete (&cache_hash, &c->hash_elem);
+    cache_install (c, to);
+    c->dirty = true;
+    c->dirty_since = timer_ticks ();
+    dirty_cnt++;
+    lock_release (&cache_lock);
 }
 
-/* 1. read a disk and load into a cache list
- * 2. copy appropriate amount of buffer into a cache 
- */
-void write_cache (disk_sector_t pos, void *buffer, off_t size, off_t ofs)
+/* throw the cached contents of sector POS away, for a delayed sector
+ * whose file is gone */
+void cache_discard (disk_sector_t pos)
 {
-    lock_acquire (&cache_lock);
-    cache_id idx = find_cache (pos);
+    cache_id idx;
 
-    /* cannot find in a cache list */
-    if (idx == -1)
+    cache_lock_acquire ();
+    while ((idx = find_cache (pos)) != -1)
+    {
+	struct cache *c = &cache_arr[idx];
+
+	if (c->pin_cnt == 0 && c->state == CACHE_VALID)
+	    cache_drop (c);
+	else
+	    cond_wait (&cache_released, &cache_lock);
+    }
+    lock_release (&cache_lock);
+}
+
+/* return a pointer to the cached contents of sector POS, which stays
+ * valid until it is handed back to cache_put ().
+ * the caller may modify the contents only if WRITE is true.
+ * callers sharing a sector must synchronize their accesses themselves. */
+void *cache_get (disk_sector_t pos, bool write)
+{
+    return cache_pin (pos, write ? CACHE_WRITE : CACHE_READ)->data;
+}
+
+/* return the cache whose contents DATA, returned by cache_get (), are */
+static struct cache *data_to_cache (const void *data)
+{
+    size_t idx = ((const uint8_t *) data - cache_pages) / DISK_SECTOR_SIZE;
+
+    ASSERT (data != NULL);
+    ASSERT (idx < cache_num && cache_arr[idx].data == data);
+
+    return &cache_arr[idx];
+}
+
+/* release DATA returned by cache_get (), marking it dirty if DIRTY */
+void cache_put (void *data, bool dirty)
+{
+    cache_unpin (data_to_cache (data), dirty);
+}
+
+/* keep read_cache () and write_cache () from copying the sector of DATA,
+ * returned by cache_get (), until cache_unlock_data (), so its contents
+ * can be read in place without seeing a copy half done */
+void cache_lock_data (const void *data)
+{
+    lock_acquire (&data_to_cache (data)->cache_lock);
+}
+
+/* let read_cache () and write_cache () copy the sector of DATA again */
+void cache_unlock_data (const void *data)
+{
+    lock_release (&data_to_cache (data)->cache_lock);
+}
+
+/* return a pinned cache holding sector POS, loading it into a free or an
+ * evicted cache if it is not in a cache list.
+ * the disk is read without cache_lock and other threads asking for POS
+ * wait until the load is over, while hits on other sectors go on.
+ * with CACHE_OVERWRITE nothing is read and the cache stays LOADING until
+ * the caller fills it in and calls cache_unpin ().
+ * a delayed sector is not on the disk, it is loaded as zeros.
+ * a writer also waits for a write back of the cache to end. */
+static struct cache *cache_pin (disk_sector_t pos, enum cache_mode mode)
+{
+    bool write = mode == CACHE_WRITE || mode == CACHE_OVERWRITE;
+    struct cache *c;
+    cache_id idx;
+
+    cache_lock_acquire ();
+    for (;;)
     {
+	idx = find_cache (pos);
+
+	/* it is already located in a cache list */
+	if (idx != -1)
+	{
+	    c = &cache_arr[idx];
+	    c->pin_cnt++;
+	    if (c->miss_pending && mode != CACHE_PREFETCH)
+	    {
+		/* the sector was loaded for this access */
+		c->miss_pending = false;
+		stats.misses++;
+	    }
+	    else if (mode != CACHE_PREFETCH)
+	    {
+		stats.hits++;
+		if (c->prefetched)
+		{
+		    c->prefetched = false;
+		    stats.read_ahead_used++;
+		}
+	    }
+	    while (c->state == CACHE_LOADING
+		    || (write && c->state == CACHE_WRITEBACK))
+		cond_wait (&c->io_done, &cache_lock);
+	    break;
+	}
+
 	/* cache list is not full */
-	if (cache_num < BUF_CACHE_SIZE)
+	if (cache_num < buf_cache_size)
+	    c = &cache_arr[cache_num++];
+	/* cache list is full */
+	else
 	{
-	    //lock_acquire (&cache_lock);
-	    cache_arr[cache_num].pos = pos;
-	    cache_arr[cache_num].accessed = false;
-
-	    if (ofs > 0 || size < DISK_SECTOR_SIZE - ofs)
-		disk_read (filesys_disk, pos, cache_arr[cache_num].data);
-	    
-	    memcpy (cache_arr[cache_num].data + ofs, buffer, size); 
-	    cache_arr[cache_num].dirty = true;
-	    cache_num ++;
-	    lock_release (&cache_lock);
+	    c = evict_cache (true);
 
+	    /* cache_lock was released while evicting, so POS may have been
+	     * loaded by another thread meanwhile */
+	    if (c == NULL)
+		continue;
 	}
-	/* cache list is full */
+
+	cache_install (c, pos);
+	c->state = CACHE_LOADING;
+	c->pin_cnt = 1;
+	c->dirty = false;
+	c->accessed = false;
+	c->miss_pending = false;
+	c->prefetched = mode == CACHE_PREFETCH;
+	if (c->prefetched)
+	    stats.read_ahead_issued++;
 	else
+	    stats.misses++;
+
+	if (mode != CACHE_OVERWRITE)
 	{
-	    //lock_acquire (&cache_lock);
-	    idx = evict_cache ();
-	    cache_arr[idx].pos = pos;
-	    cache_arr[idx].dirty = false;
-
-	    if (ofs > 0 || size < DISK_SECTOR_SIZE - ofs)
-		disk_read (filesys_disk, pos, cache_arr[idx].data);
-	    
-	    memcpy (cache_arr[idx].data + ofs, buffer, size); 
-	    cache_arr[idx].dirty = true;
 	    lock_release (&cache_lock);
+	    if (pos >= CACHE_DELAYED_BASE)
+		memset (c->data, 0, DISK_SECTOR_SIZE);
+	    else
+		disk_read (filesys_disk, pos, c->data);
+	    cache_lock_acquire ();
+
+	    c->state = CACHE_VALID;
+	    cond_broadcast (&c->io_done, &cache_lock);
 	}
+	break;
+    }
+
+    /* a prefetched cache is not marked accessed, so it is the first
+     * to be evicted if nobody reads it */
+    if (mode != CACHE_PREFETCH)
+	c->accessed = true;
+    lock_release (&cache_lock);
+
+    return c;
+}
+
+/* release a cache pinned by cache_pin (), marking it dirty if DIRTY */
+static void cache_unpin (struct cache *c, bool dirty)
+{
+    bool too_dirty;
 
+    cache_lock_acquire ();
+
+    ASSERT (c->pin_cnt > 0);
+
+    /* a cache overwritten as a whole is valid now */
+    if (c->state == CACHE_LOADING)
+    {
+	c->state = CACHE_VALID;
+	cond_broadcast (&c->io_done, &cache_lock);
     }
-    /* it is already located in a cache list */
-    else
+
+    /* a delayed sector becomes dirty only once it has a disk sector */
+    if (dirty && !c->dirty && c->pos < CACHE_DELAYED_BASE)
     {
-	lock_release (&cache_lock);
-	lock_acquire (&cache_arr[idx].cache_lock);
-	memcpy (cache_arr[idx].data + ofs, buffer, size); 
-	cache_arr[idx].dirty = true;
-	lock_release (&cache_arr[idx].cache_lock);
+	c->dirty = true;
+	c->dirty_since = timer_ticks ();
+	dirty_cnt++;
     }
+    if (--c->pin_cnt == 0)
+	cond_broadcast (&cache_released, &cache_lock);
+
+    too_dirty = dirty_cnt * 100 > buf_cache_size * BUF_DIRTY_HIGH;
+    lock_release (&cache_lock);
+
+    /* a writer which fills the cache with dirty data above the high-water
+     * mark writes it back itself instead of waiting for the write behind
+     * thread */
+    if (dirty && too_dirty)
+	cache_flush (0);
 }
 
-/* evict a cache in a cache list by the clock algorithm */
-static cache_id evict_cache (void)
+/* evict a cache in a cache list by the clock (second chance) algorithm
+ * and return it unbound.
+ * the clock hand keeps its position between calls, and a cache which is
+ * accessed since the hand passed it loses its accessed bit and survives.
+ * a cache freed by cache_drop () is taken first.
+ * pinned caches, caches in the middle of an I/O and delayed sectors are
+ * skipped.
+ * if a dirty victim is written back, or every cache is in use and WAIT
+ * is true, NULL is returned after cache_lock is released and
+ * reacquired, so the caller looks its sector up again before retrying.
+ * if every cache is in use and WAIT is false, NULL is returned at once.
+ * (cache_lock must be held) */
+static struct cache *evict_cache (bool wait)
 {
-    ASSERT (cache_num == BUF_CACHE_SIZE);
+    ASSERT (cache_num == buf_cache_size);
 
-    int i;
+    size_t sweep;
 
-    for (i = 0; i < BUF_CACHE_SIZE; i++)
+    for (sweep = 0; ; sweep++)
     {
-	if (!cache_arr[i].dirty && !cache_arr[i].accessed)
+	struct cache *c = &cache_arr[clock_hand];
+	clock_hand = (clock_hand + 1) % buf_cache_size;
+
+	/* every cache is in use, wait until one is released */
+	if (sweep == 2 * buf_cache_size)
 	{
-	    lock_acquire (&cache_arr[i].cache_lock);
-	    cache_clear (i);
-	    lock_release (&cache_arr[i].cache_lock);
-	    return i;
+	    if (wait)
+		cond_wait (&cache_released, &cache_lock);
+	    return NULL;
 	}
-    }
 
-    for (i = 0; i < BUF_CACHE_SIZE; i++)
-    {
-	if (cache_arr[i].dirty && !cache_arr[i].accessed)
+	if (c->state == CACHE_FREE && c->pin_cnt == 0)
+	    return c;
+
+	if (c->pin_cnt > 0 || c->state != CACHE_VALID
+		|| c->pos >= CACHE_DELAYED_BASE)
+	    continue;
+
+	/* second chance */
+	if (c->accessed)
 	{
-	    lock_acquire (&cache_arr[i].cache_lock);
-	    disk_write (filesys_disk, cache_arr[i].pos, cache_arr[i].data);
-	    cache_clear (i);
-	    lock_release (&cache_arr[i].cache_lock);
-	    return i;
+	    c->accessed = false;
+	    continue;
 	}
+
+	if (!c->dirty)
+	{
+	    hash_delete (&cache_hash, &c->hash_elem);
+	    c->state = CACHE_FREE;
+	    stats.clean_evictions++;
+	    if (c->prefetched)
+		stats.read_ahead_wasted++;
+	    return c;
+	}
+
+	stats.dirty_evictions++;
+	cache_write_back (c);
+	return NULL;
     }
+}
 
+/* write a dirty, unpinned cache C back to the disk.
+ * C remains in a cache list and can be read during the write, but
+ * writers wait until it is over.
+ * (cache_lock must be held, it is released during the write) */
+static void cache_write_back (struct cache *c)
+{
+    ASSERT (c->state == CACHE_VALID && c->dirty);
 
-    for (i = 0; i < BUF_CACHE_SIZE; i++)
+    c->state = CACHE_WRITEBACK;
+    c->dirty = false;
+    dirty_cnt--;
+    stats.writebacks++;
+    lock_release (&cache_lock);
+
+    disk_write (filesys_disk, c->pos, c->data);
+
+    cache_lock_acquire ();
+    c->state = CACHE_VALID;
+    cond_broadcast (&c->io_done, &cache_lock);
+    cond_broadcast (&cache_released, &cache_lock);
+}
+
+/* write all dirty cache into disk.
+ * caches pinned by writers are left for the next flush */
+void cache_to_disk (void)
+{
+    cache_flush (0);
+}
+
+/* write back dirty caches which have been dirty for MIN_AGE ticks or
+ * more, in ascending sector order so the disk head sweeps across the
+ * disk once.  the caches are all marked WRITEBACK before the first write,
+ * and each run of adjacent sectors goes to the disk as one request.
+ * the caches of a run are valid again as soon as the run is written,
+ * so a writer waits for its own sector, not for the whole sweep. */
+static void cache_flush (int64_t min_age)
+{
+    size_t i, cnt = 0;
+    int64_t now = timer_ticks ();
+
+    lock_acquire (&flush_lock);
+    cache_lock_acquire ();
+
+    for (i = 0; i < cache_num; i++)
     {
-	if (!cache_arr[i].dirty && cache_arr[i].accessed)
+	struct cache *c = &cache_arr[i];
+
+	if (c->dirty && c->state == CACHE_VALID && c->pin_cnt == 0
+		&& now - c->dirty_since >= min_age)
 	{
-	    lock_acquire (&cache_arr[i].cache_lock);
-	    cache_clear (i);
-	    lock_release (&cache_arr[i].cache_lock);
-	    return i;
+	    c->state = CACHE_WRITEBACK;
+	    c->dirty = false;
+	    dirty_cnt--;
+	    stats.writebacks++;
+	    flush_batch[cnt++] = c;
 	}
     }
 
+    lock_release (&cache_lock);
 
-    for (i = 0; i < BUF_CACHE_SIZE; i++)
+    qsort (flush_batch, cnt, sizeof *flush_batch, cache_pos_compare);
+    for (i = 0; i < cnt; )
     {
-	if (cache_arr[i].dirty && cache_arr[i].accessed)
+	size_t n = 0;
+
+	do
+	{
+	    flush_data[n] = flush_batch[i + n]->data;
+	    n++;
+	}
+	while (i + n < cnt
+		&& flush_batch[i + n]->pos == flush_batch[i]->pos + n);
+
+	disk_write_multiple (filesys_disk, flush_batch[i]->pos, flush_data, n);
+
+	cache_lock_acquire ();
+	for (; n > 0; n--, i++)
 	{
-	    lock_acquire (&cache_arr[i].cache_lock);
-	    disk_write (filesys_disk, cache_arr[i].pos, cache_arr[i].data);
-	    cache_clear (i);
-	    lock_release (&cache_arr[i].cache_lock);
-	    return i;
+	    flush_batch[i]->state = CACHE_VALID;
+	    cond_broadcast (&flush_batch[i]->io_done, &cache_lock);
 	}
+	cond_broadcast (&cache_released, &cache_lock);
+	lock_release (&cache_lock);
     }
 
-    return -1;
+    lock_release (&flush_lock);
 }
 
-/* clear a cache */
-static void cache_clear (cache_id idx)
+/* order caches in flush_batch by their sector numbers */
+static int cache_pos_compare (const void *a_, const void *b_)
 {
-    memset (&cache_arr[idx].data, 0, sizeof cache_arr[idx].data);
-    cache_arr[idx].pos = 0;
-    cache_arr[idx].accessed = false;
-    cache_arr[idx].dirty = false;
+    const struct cache *a = *(struct cache * const *) a_;
+    const struct cache *b = *(struct cache * const *) b_;
+
+    return a->pos < b->pos ? -1 : a->pos > b->pos;
 }
 
-/* 1. write all dirty cache into disk 
- * 2. set all cache accessed false 
- */
-void cache_to_disk (void)
+/* load the uncached sectors among the CNT sectors from START into the
+ * cache, each run of consecutive uncached sectors by a single disk
+ * request which fills several caches at once.
+ * at most CACHE_RUN_MAX sectors, and a quarter of the cache, are looked
+ * at.  a run is cut short when no cache is free or clean, and the
+ * sectors left are loaded one by one by cache_pin () when they are used.
+ * the caches are loaded for a reader unless PREFETCH is true.
+ * return the number of sectors looked at */
+size_t cache_load_run (disk_sector_t start, size_t cnt, bool prefetch)
 {
-    int i;
+    struct cache *run[CACHE_RUN_MAX];
+    void *data[CACHE_RUN_MAX];
+    size_t i = 0, max = buf_cache_size / 4;
+
+    if (max > CACHE_RUN_MAX)
+	max = CACHE_RUN_MAX;
+    if (cnt > max)
+	cnt = max > 0 ? max : 1;
+    if (start + cnt > disk_length)
+	cnt = start < disk_length ? disk_length - start : 0;
+
+    cache_lock_acquire ();
+    while (i < cnt)
+    {
+	size_t n = 0, k;
 
-    lock_acquire (&cache_lock);
+	/* bind caches to a run of uncached sectors, pinned and LOADING so
+	 * other threads wait for the run instead of reading it again */
+	while (i + n < cnt && find_cache (start + i + n) == -1)
+	{
+	    struct cache *c;
+
+	    if (cache_num < buf_cache_size)
+		c = &cache_arr[cache_num++];
+	    else if ((c = evict_cache (false)) == NULL)
+		break;
+
+	    cache_install (c, start + i + n);
+	    c->state = CACHE_LOADING;
+	    c->pin_cnt = 1;
+	    c->dirty = false;
+	    c->accessed = false;
+	    c->prefetched = prefetch;
+	    c->miss_pending = !prefetch;
+	    if (prefetch)
+		stats.read_ahead_issued++;
+	    run[n] = c;
+	    data[n] = c->data;
+	    n++;
+	}
 
-    for (i = 0; i < cache_num ; i++)
+	/* skip a cached sector, give up if no cache can be had */
+	if (n == 0)
+	{
+	    if (find_cache (start + i) == -1)
+		break;
+	    i++;
+	    continue;
+	}
+
+	lock_release (&cache_lock);
+	disk_read_multiple (filesys_disk, start + i, data, n);
+	cache_lock_acquire ();
+
+	for (k = 0; k < n; k++)
+	{
+	    run[k]->state = CACHE_VALID;
+	    cond_broadcast (&run[k]->io_done, &cache_lock);
+	    if (--run[k]->pin_cnt == 0)
+		cond_broadcast (&cache_released, &cache_lock);
+	}
+	i += n;
+    }
+    lock_release (&cache_lock);
+
+    return cnt;
+}
+
+/* queue sector POS to be loaded by the read ahead thread.
+ * read ahead is only a hint, so the request is dropped if the queue is
+ * full or POS is beyond the disk */
+void cache_read_ahead (disk_sector_t pos)
+{
+    if (pos >= disk_length)
+	return;
+
+    lock_acquire (&read_ahead_lock);
+
+    if (read_ahead_cnt < READ_AHEAD_QUEUE_SIZE)
     {
-	cache_arr[i].accessed = false;
-	if (cache_arr[i].dirty)
-	    disk_write (filesys_disk, cache_arr[i].pos, cache_arr[i].data);
+	read_ahead_queue[(read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE] = pos;
+	read_ahead_cnt++;
+	cond_signal (&read_ahead_cond, &read_ahead_lock);
     }
 
-    lock_release (&cache_lock);
+    lock_release (&read_ahead_lock);
 }
 
 /* read ahead function using a condition variable (similar to the producer part in the lecture */
@@ -278,54 +762,52 @@ void thread_read_ahead (void *aux UNUSED)
     while (true)
     {
 	lock_acquire (&read_ahead_lock);
-	while (list_empty (&read_ahead_list))
+	while (read_ahead_cnt == 0)
 	    cond_wait (&read_ahead_cond, &read_ahead_lock);
 
-	/* critical section - read ahead */
-	struct list_elem *elem = list_pop_front (&read_ahead_list);
-	struct read_ahead *ra = list_entry (elem, struct read_ahead, read_ahead_elem);
-
-	disk_sector_t pos = ra->pos;
+	/* critical section - read ahead
+	 * requests for consecutive sectors are taken together */
+	disk_sector_t pos = read_ahead_queue[read_ahead_head];
+	size_t cnt = 0;
 
-	lock_acquire (&cache_lock);	
-	cache_id idx = find_cache (pos);
-
-	if (idx == -1)
+	do
 	{
-	    if (cache_num < BUF_CACHE_SIZE)
-	    {
-		cache_arr[cache_num].pos = pos;
-		cache_arr[cache_num].dirty = false;
-		cache_arr[cache_num].accessed = true;
-		disk_read (filesys_disk, pos, cache_arr[cache_num].data);
-		cache_num ++;
-		
-	    }
-	    else
-	    {
-		idx = evict_cache ();
-		cache_arr[idx].pos = pos;
-		cache_arr[idx].dirty = false;
-		cache_arr[idx].accessed = true;
-		disk_read (filesys_disk, pos, cache_arr[idx].data);	
-	    }
-	    
+	    read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+	    read_ahead_cnt--;
+	    cnt++;
 	}
-	
-	lock_release (&cache_lock);
+	while (read_ahead_cnt > 0 && cnt < CACHE_RUN_MAX
+		&& read_ahead_queue[read_ahead_head] == pos + cnt);
 
-	free (ra);
 	lock_release (&read_ahead_lock);
+
+	/* load without read_ahead_lock, so readers can queue requests */
+	while (cnt > 0)
+	{
+	    size_t done = cache_load_run (pos, cnt, true);
+
+	    /* the cache is too busy for a run */
+	    if (done == 0)
+		break;
+	    pos += done;
+	    cnt -= done;
+	}
     }
 }
 
-/* write priodically  */
+/* write behind thread, which writes back caches dirty for longer than
+ * BUF_DIRTY_AGE every BUF_WRITE_TICKS.  it sleeps between rounds, so it
+ * takes little CPU, yet it runs at PRI_DEFAULT: it holds the map locks
+ * of inodes and keeps caches in WRITEBACK, which donate no priority, so
+ * at a lower priority it would stall the threads waiting for them.
+ * delayed sectors get their disk sectors first, so the data appended to
+ * a file since the last round is written back as one run. */
 static void periodic_write (void *aux UNUSED)
 {
     while (true)
     {
 	timer_sleep (BUF_WRITE_TICKS);
-	cache_to_disk ();
+	inode_flush_delayed ();
+	cache_flush (BUF_DIRTY_AGE);
     }
 }
-
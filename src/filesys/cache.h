@@ -3,17 +3,44 @@
 
 #include "devices/disk.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <cache-stat.h>
 #include "threads/synch.h"
 #include "filesys/off_t.h"
 
-#define BUF_CACHE_SIZE 64 
+#define BUF_CACHE_SIZE 64 		/* default number of cached sectors */
+/* fewest cached sectors: a growing file keeps an indirect block pinned
+ * while it zeroes sectors, and cache_load_run () loads up to a quarter
+ * of the cache at once, so a smaller cache could wait on itself */
+#define BUF_CACHE_MIN 8
+#define CACHE_RUN_MAX 32		/* sectors loaded by one cache_load_run () */
+
+/* sectors numbered from CACHE_DELAYED_BASE up are not on the disk, they
+ * hold file data which has no disk sector yet.  such a cache starts out
+ * zeroed, and it is neither evicted nor written back until it is renamed
+ * to a disk sector by cache_rename () */
+#define CACHE_DELAYED_BASE 0x80000000u
 typedef int cache_id;
 
+/* number of cached sectors, set by the -cache kernel option */
+extern size_t buf_cache_size;
+
 void init_cache (void);
 cache_id find_cache (disk_sector_t);
 void read_cache (disk_sector_t, void*, off_t, off_t);
 void write_cache (disk_sector_t, void*, off_t, off_t); 
+void cache_zero (disk_sector_t);
+void cache_rename (disk_sector_t from, disk_sector_t to);
+void cache_discard (disk_sector_t);
+void *cache_get (disk_sector_t, bool write);
+void cache_put (void *, bool dirty);
+void cache_lock_data (const void *);
+void cache_unlock_data (const void *);
 void cache_to_disk (void);
+void cache_read_ahead (disk_sector_t);
+size_t cache_load_run (disk_sector_t, size_t cnt, bool prefetch);
+void cache_get_stat (struct cache_stat *);
+void cache_print_stats (void);
 void thread_read_ahead (void *aux);
 
 #endif
@@ -0,0 +1,238 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Number of names cached at most.  The least recently used name
+   is dropped to make room for a new one. */
+#define DCACHE_SIZE 256
+
+/* A name looked up in a directory, and what it was found to be. */
+struct dcache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in dcache. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    disk_sector_t parent;               /* Inode sector of the directory. */
+    char name[NAME_MAX + 1];            /* Name in that directory. */
+    disk_sector_t sector;               /* Inode sector it names, 0 if
+                                           it does not exist. */
+    bool is_dir;                        /* True if it names a directory. */
+  };
+
+/* Names cached, indexed by directory and name, and ordered from
+   the most to the least recently used.  Sector 0 holds the free
+   map, so no name stands for it, and an entry for sector 0 caches
+   that a name does not exist.
+   An entry is dropped when the name is added to or removed from
+   its directory, and all entries of a directory when the sectors of
+   the removed directory are released, before its sector can be used
+   again. */
+static struct hash dcache;
+static struct list lru_list;
+static unsigned generation;             /* Bumped by every invalidation. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+static long long hits, negative_hits, misses;
+
+static unsigned dcache_hash_func (const struct hash_elem *, void *);
+static bool dcache_less_func (const struct hash_elem *,
+                              const struct hash_elem *, void *);
+static struct dcache_entry *find (disk_sector_t, const char *);
+static void drop (struct dcache_entry *);
+
+/* Initializes the name cache. */
+void
+dcache_init (void)
+{
+  if (!hash_init (&dcache, dcache_hash_func, dcache_less_func, NULL))
+    PANIC ("name cache creation failed");
+  list_init (&lru_list);
+  lock_init (&dcache_lock);
+}
+
+/* Looks NAME up in the directory whose inode is at PARENT.
+   Returns false if the name is not cached.  Otherwise sets *SECTORP
+   to the inode sector it names, 0 if it does not exist, and
+   *IS_DIRP to whether it is a directory, and returns true. */
+bool
+dcache_lookup (disk_sector_t parent, const char *name,
+               disk_sector_t *sectorp, bool *is_dirp)
+{
+  struct dcache_entry *e;
+
+  lock_acquire (&dcache_lock);
+  e = find (parent, name);
+  if (e != NULL)
+    {
+      *sectorp = e->sector;
+      *is_dirp = e->is_dir;
+      list_remove (&e->lru_elem);
+      list_push_front (&lru_list, &e->lru_elem);
+      if (e->sector != 0)
+        hits++;
+      else
+        negative_hits++;
+    }
+  else
+    misses++;
+  lock_release (&dcache_lock);
+
+  return e != NULL;
+}
+
+/* Returns the number of invalidations so far.  A caller reads it
+   before it looks a name up in a directory, and hands it to
+   dcache_insert() with what it found. */
+unsigned
+dcache_generation (void)
+{
+  unsigned g;
+
+  lock_acquire (&dcache_lock);
+  g = generation;
+  lock_release (&dcache_lock);
+  return g;
+}
+
+/* Caches that NAME in the directory whose inode is at PARENT names
+   the inode at SECTOR, which is a directory if IS_DIR is true, or
+   that it does not exist if SECTOR is 0.
+   Nothing is cached if any name was invalidated since GENERATION
+   was read from dcache_generation(), because the directory may have
+   changed after it was looked at. */
+void
+dcache_insert (disk_sector_t parent, const char *name,
+               disk_sector_t sector, bool is_dir, unsigned generation_)
+{
+  struct dcache_entry *e;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  if (generation_ != generation)
+    {
+      lock_release (&dcache_lock);
+      return;
+    }
+  e = find (parent, name);
+  if (e == NULL)
+    {
+      if (hash_size (&dcache) >= DCACHE_SIZE)
+        drop (list_entry (list_back (&lru_list), struct dcache_entry,
+                          lru_elem));
+      e = malloc (sizeof *e);
+      if (e != NULL)
+        {
+          e->parent = parent;
+          strlcpy (e->name, name, sizeof e->name);
+          hash_insert (&dcache, &e->hash_elem);
+          list_push_front (&lru_list, &e->lru_elem);
+        }
+    }
+  if (e != NULL)
+    {
+      e->sector = sector;
+      e->is_dir = is_dir;
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Forgets NAME in the directory whose inode is at PARENT. */
+void
+dcache_invalidate (disk_sector_t parent, const char *name)
+{
+  struct dcache_entry *e;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  e = find (parent, name);
+  if (e != NULL)
+    drop (e);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name in the directory whose inode is at PARENT. */
+void
+dcache_invalidate_dir (disk_sector_t parent)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); e = next)
+    {
+      struct dcache_entry *de = list_entry (e, struct dcache_entry, lru_elem);
+
+      next = list_next (e);
+      if (de->parent == parent)
+        drop (de);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints the name cache statistics. */
+void
+dcache_print_stats (void)
+{
+  lock_acquire (&dcache_lock);
+  printf ("Name cache: %lld hits, %lld negative hits, %lld misses\n",
+          hits, negative_hits, misses);
+  lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in the directory at PARENT, or a null
+   pointer if there is none.  dcache_lock must be held. */
+static struct dcache_entry *
+find (disk_sector_t parent, const char *name)
+{
+  struct dcache_entry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+
+  key.parent = parent;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dcache, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dcache_entry, hash_elem) : NULL;
+}
+
+/* Removes E from the cache and frees it.  dcache_lock must be
+   held. */
+static void
+drop (struct dcache_entry *e)
+{
+  hash_delete (&dcache, &e->hash_elem);
+  list_remove (&e->lru_elem);
+  free (e);
+}
+
+/* Hash function of dcache: an entry is hashed by its directory and
+   name. */
+static unsigned
+dcache_hash_func (const struct hash_elem *e_, void *aux UNUSED)
+{
+  const struct dcache_entry *e = hash_entry (e_, struct dcache_entry,
+                                             hash_elem);
+  return hash_string (e->name) ^ hash_int (e->parent);
+}
+
+/* Comparison function of dcache. */
+static bool
+dcache_less_func (const struct hash_elem *a_, const struct hash_elem *b_,
+                  void *aux UNUSED)
+{
+  const struct dcache_entry *a = hash_entry (a_, struct dcache_entry,
+                                             hash_elem);
+  const struct dcache_entry *b = hash_entry (b_, struct dcache_entry,
+                                             hash_elem);
+
+  if (a->parent != b->parent)
+    return a->parent < b->parent;
+  return strcmp (a->name, b->name) < 0;
+}
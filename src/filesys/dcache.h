@@ -0,0 +1,17 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+void dcache_init (void);
+bool dcache_lookup (disk_sector_t parent, const char *name,
+                    disk_sector_t *sectorp, bool *is_dirp);
+unsigned dcache_generation (void);
+void dcache_insert (disk_sector_t parent, const char *name,
+                    disk_sector_t sector, bool is_dir, unsigned generation);
+void dcache_invalidate (disk_sector_t parent, const char *name);
+void dcache_invalidate_dir (disk_sector_t parent);
+void dcache_print_stats (void);
+
+#endif /* filesys/dcache.h */
@@ -1,12 +1,39 @@
 #include "filesys/directory.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
+/* A directory with more than DIR_INDEX_MIN entries gets a hashed
+   index, so looking up, adding and removing a name does not scan
+   all of its entries.  Smaller directories are only scanned. */
+#define DIR_INDEX_MIN 32
+
+/* A directory index is a file of its own, holding this header and
+   then SLOT_CNT slots of an open-addressed hash table of the names
+   in the directory.  A slot holds the number of a directory entry
+   plus one, 0 if it is empty, or SLOT_DELETED.  The entries stay
+   where they are, the index only points to them.
+   The index is kept open by the inode of the directory, and is
+   fetched from it by every operation.  Entries and index change under
+   the inode lock of the directory. */
+struct dir_index
+{
+  uint32_t slot_cnt;                  /* Number of slots, a power of 2. */
+  uint32_t used_cnt;                  /* Slots not empty, deleted ones too. */
+  uint32_t free_hint;                 /* No free entry comes before it. */
+};
+
+/* A slot whose entry was removed, which does not end a probe. */
+#define SLOT_DELETED UINT32_MAX
+
 /* A directory. */
 struct dir 
 {
@@ -84,6 +111,207 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+/* Returns the byte offset of slot SLOT in a directory index. */
+static inline off_t
+slot_ofs (uint32_t slot)
+{
+  return sizeof (struct dir_index) + slot * sizeof (uint32_t);
+}
+
+/* Searches INDEX, the index of DIR, for a file with the given NAME,
+   as lookup() does.  Sets *SLOTP to the slot that points to its
+   entry if SLOTP is non-null. */
+static bool
+index_lookup (const struct dir *dir, struct inode *index, const char *name,
+    struct dir_entry *ep, off_t *ofsp, uint32_t *slotp)
+{
+  struct dir_index h;
+  uint32_t mask, slot, i;
+
+  if (inode_read_at (index, &h, sizeof h, 0) != sizeof h)
+    return false;
+
+  mask = h.slot_cnt - 1;
+  slot = hash_string (name) & mask;
+  for (i = 0; i < h.slot_cnt; i++, slot = (slot + 1) & mask)
+  {
+    struct dir_entry e;
+    uint32_t entry;
+    off_t ofs;
+
+    inode_read_at (index, &entry, sizeof entry, slot_ofs (slot));
+    if (entry == 0)
+      break;
+    if (entry == SLOT_DELETED)
+      continue;
+
+    ofs = (entry - 1) * sizeof e;
+    if (inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e
+	&& e.in_use && !strcmp (name, e.name))
+    {
+      if (ep != NULL)
+	*ep = e;
+      if (ofsp != NULL)
+	*ofsp = ofs;
+      if (slotp != NULL)
+	*slotp = slot;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Rewrites INDEX, the index of DIR, with SLOT_CNT slots, a power of
+   2 at least twice the number of entries of DIR, pointing to every
+   entry in use.
+   Returns false if memory or disk allocation fails. */
+static bool
+index_build (struct dir *dir, struct inode *index, uint32_t slot_cnt)
+{
+  struct dir_index *h;
+  uint32_t *slots, mask, entry;
+  struct dir_entry e;
+  size_t size = slot_ofs (slot_cnt);
+  bool success;
+
+  h = calloc (1, size);
+  if (h == NULL)
+    return false;
+  slots = (uint32_t *) (h + 1);
+  mask = slot_cnt - 1;
+
+  h->slot_cnt = slot_cnt;
+  h->free_hint = UINT32_MAX;
+  for (entry = 0; inode_read_at (dir->inode, &e, sizeof e,
+				 entry * sizeof e) == sizeof e; entry++)
+  {
+    uint32_t slot = hash_string (e.name) & mask;
+
+    if (!e.in_use)
+    {
+      if (h->free_hint == UINT32_MAX)
+	h->free_hint = entry;
+      continue;
+    }
+
+    while (slots[slot] != 0)
+      slot = (slot + 1) & mask;
+    slots[slot] = entry + 1;
+    h->used_cnt++;
+  }
+  if (h->free_hint == UINT32_MAX)
+    h->free_hint = entry;
+
+  success = inode_write_at (index, h, size, 0) == (off_t) size;
+  free (h);
+  return success;
+}
+
+/* Gives DIR, which has no index, an index of all its entries.
+   The inode lock of DIR must be held, so no other index is made at
+   the same time. */
+static void
+index_create (struct dir *dir)
+{
+  struct inode *index;
+  disk_sector_t sector;
+  uint32_t slot_cnt = 4 * DIR_INDEX_MIN;
+
+  while (slot_cnt < 2 * inode_length (dir->inode) / sizeof (struct dir_entry))
+    slot_cnt *= 2;
+
+  if (!free_map_allocate_near (inode_get_inumber (dir->inode), 1, &sector))
+    return;
+  if (!inode_create (sector, 0, false)
+      || (index = inode_open (sector)) == NULL)
+  {
+    free_map_release (sector, 1);
+    return;
+  }
+
+  if (index_build (dir, index, slot_cnt))
+    inode_set_dir_index (dir->inode, index);
+  else
+    /* nothing points to the index, so it is freed when it is closed */
+    inode_remove (index);
+  inode_close (index);
+}
+
+/* Points a slot of INDEX, the index of DIR, for NAME at entry ENTRY, the
+   first free entry from the free hint, and moves the hint past it.  The index doubles
+   once more than half of its slots are used.
+   Returns false if the index cannot be updated. */
+static bool
+index_insert (struct dir *dir, struct inode *index, const char *name,
+	      uint32_t entry)
+{
+  struct dir_index h;
+  uint32_t mask, slot, value;
+
+  if (inode_read_at (index, &h, sizeof h, 0) != sizeof h)
+    return false;
+  if (2 * (h.used_cnt + 1) > h.slot_cnt)
+    return index_build (dir, index, 2 * h.slot_cnt);
+
+  mask = h.slot_cnt - 1;
+  slot = hash_string (name) & mask;
+  for (;;)
+  {
+    inode_read_at (index, &value, sizeof value, slot_ofs (slot));
+    if (value == 0 || value == SLOT_DELETED)
+      break;
+    slot = (slot + 1) & mask;
+  }
+
+  if (value == 0)
+    h.used_cnt++;
+  if (h.free_hint <= entry)
+    h.free_hint = entry + 1;
+  value = entry + 1;
+  return (inode_write_at (index, &value, sizeof value, slot_ofs (slot))
+	  == sizeof value)
+    && inode_write_at (index, &h, sizeof h, 0) == sizeof h;
+}
+
+/* Marks slot SLOT of directory index INDEX, which points to entry
+   ENTRY, as deleted. */
+static void
+index_remove (struct inode *index, uint32_t slot, uint32_t entry)
+{
+  struct dir_index h;
+  uint32_t value = SLOT_DELETED;
+
+  inode_write_at (index, &value, sizeof value, slot_ofs (slot));
+  if (inode_read_at (index, &h, sizeof h, 0) == sizeof h
+      && entry < h.free_hint)
+  {
+    h.free_hint = entry;
+    inode_write_at (index, &h, sizeof h, 0);
+  }
+}
+
+/* Stands in for a sector of a directory which is a hole: all of its
+   entries are unused. */
+static const uint8_t hole_block[DISK_SECTOR_SIZE];
+
+/* Returns the sector of DIR holding byte OFFSET, locked as by
+   inode_get_block(), or HOLE_BLOCK if that sector is a hole. */
+static const uint8_t *
+get_dir_block (const struct dir *dir, off_t offset)
+{
+  const uint8_t *block = inode_get_block (dir->inode, offset);
+
+  return block != NULL ? block : hole_block;
+}
+
+/* Releases BLOCK returned by get_dir_block(). */
+static void
+put_dir_block (const uint8_t *block)
+{
+  if (block != hole_block)
+    inode_put_block (block);
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -94,44 +322,104 @@ lookup (const struct dir *dir, const char *name,
     struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
-  size_t ofs;
+  struct inode *index;
+  const uint8_t *block = NULL;
+  off_t block_idx = -1;
+  off_t length, ofs;
+  bool found = false;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-      ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
+  index = inode_open_dir_index (dir->inode);
+  if (index != NULL)
+  {
+    found = index_lookup (dir, index, name, ep, ofsp, NULL);
+    inode_close (index);
+    return found;
+  }
+
+  /* Entries are compared in place in the buffer cache, with their
+     sector locked so that dir_add() or dir_remove() cannot change
+     one halfway through.  Only an entry which straddles two sectors
+     is copied into E.  A sector which is a hole reads as unused
+     entries. */
+  length = inode_length (dir->inode);
+  for (ofs = 0; ofs + (off_t) sizeof e <= length; ofs += sizeof e) 
+  {
+    const struct dir_entry *p;
+    size_t sector_ofs = ofs % DISK_SECTOR_SIZE;
+
+    if (ofs / DISK_SECTOR_SIZE != block_idx)
+    {
+      if (block != NULL)
+	put_dir_block (block);
+      block = get_dir_block (dir, ofs);
+      block_idx = ofs / DISK_SECTOR_SIZE;
+    }
+
+    if (sector_ofs + sizeof e <= DISK_SECTOR_SIZE)
+      p = (const struct dir_entry *) (block + sector_ofs);
+    else
+    {
+      size_t head = DISK_SECTOR_SIZE - sector_ofs;
+
+      memcpy (&e, block + sector_ofs, head);
+      put_dir_block (block);
+      block = get_dir_block (dir, ofs + head);
+      block_idx++;
+      memcpy ((uint8_t *) &e + head, block, sizeof e - head);
+      p = &e;
+    }
+
+    if (p->in_use && !strcmp (name, p->name)) 
     {
       if (ep != NULL)
-	*ep = e;
+	*ep = *p;
       if (ofsp != NULL)
 	*ofsp = ofs;
-      return true;
+      found = true;
+      break;
     }
-  return false;
+  }
+
+  if (block != NULL)
+    put_dir_block (block);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   The name cache is asked first, and learns what DIR says. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
     struct inode **inode) 
 {
   struct dir_entry e;
+  disk_sector_t parent, sector;
+  unsigned generation = 0;
+  bool cached, is_dir;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
+  parent = inode_get_inumber (dir->inode);
+  cached = dcache_lookup (parent, name, &sector, &is_dir);
+  if (!cached)
   {
-    *inode = inode_open (e.inode_sector);
-    set_parentdir (*inode, inode_reopen (dir_get_inode (dir)));
+    generation = dcache_generation ();
+    sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
   }
-  else
-    *inode = NULL;
+
+  *inode = sector != 0 ? inode_open (sector) : NULL;
+  if (*inode != NULL)
+    set_parentdir (*inode, inode_reopen (dir->inode));
+
+  if (!cached && (sector == 0 || *inode != NULL))
+    dcache_insert (parent, name, sector,
+		   *inode != NULL && inode_is_dir (*inode), generation);
 
   return *inode != NULL;
 }
@@ -146,7 +434,9 @@ bool
 dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) 
 {
   struct dir_entry e;
-  off_t ofs;
+  struct dir_index h;
+  struct inode *index = NULL;
+  off_t ofs = 0;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -157,9 +447,16 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
     return false;
 
   /* Check that NAME is not in use. */
+  inode_lock_dir (dir->inode);
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  /* An index knows where the first free slot may be. */
+  index = inode_open_dir_index (dir->inode);
+  if (index != NULL
+      && inode_read_at (index, &h, sizeof h, 0) == sizeof h)
+    ofs = h.free_hint * sizeof e;
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
@@ -167,7 +464,7 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
      inode_read_at() will only return a short read at end of file.
      Otherwise, we'd need to verify that we didn't get a short
      read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  for (; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
       ofs += sizeof e) 
     if (!e.in_use)
       break;
@@ -178,7 +475,26 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
+  /* Point the index to the entry, or make an index for a directory
+     which has grown large.  A directory whose index cannot be
+     updated loses it and is scanned again. */
+  if (success && index != NULL
+      && !index_insert (dir, index, name, ofs / sizeof e))
+  {
+    inode_set_dir_index (dir->inode, NULL);
+    inode_remove (index);
+  }
+  else if (success && index == NULL
+	   && inode_length (dir->inode) / sizeof e > DIR_INDEX_MIN)
+    index_create (dir);
+
+  /* NAME may be cached as not existing */
+  if (success)
+    dcache_invalidate (inode_get_inumber (dir->inode), name);
+
 done:
+  inode_close (index);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -190,14 +506,20 @@ dir_remove (struct dir *dir, const char *name)
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  struct inode *index;
   bool success = false;
+  uint32_t slot = 0;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
   /* Find directory entry. */
-  if (!lookup (dir, name, &e, &ofs))
+  inode_lock_dir (dir->inode);
+  index = inode_open_dir_index (dir->inode);
+  if (index != NULL
+      ? !index_lookup (dir, index, name, &e, &ofs, &slot)
+      : !lookup (dir, name, &e, &ofs))
     goto done;
 
   /* Open inode. */
@@ -215,6 +537,12 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  if (index != NULL)
+    index_remove (index, slot, ofs / sizeof e);
+
+  /* forget NAME; the names in it, if it is a directory, are forgotten
+     when its sector is released */
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
 
   /* Remove inode. */
   inode_remove (inode);
@@ -222,6 +550,8 @@ dir_remove (struct dir *dir, const char *name)
 
 done:
   inode_close (inode);
+  inode_close (index);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -244,6 +574,66 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
   return false;
 }
 
+/* Reads up to CNT of the next directory entries in DIR into
+   ENTRIES, with the inode number of each and whether it is a
+   directory.  Returns the number of entries read, 0 if the
+   directory contains no more entries.
+   Entries are read from the directory a sector's worth at a
+   time, and the name cache answers for the type of most of
+   them without opening their inodes. */
+size_t
+dir_readdir_batch (struct dir *dir, struct dirent *entries, size_t cnt)
+{
+  struct dir_entry e[DISK_SECTOR_SIZE / sizeof (struct dir_entry)];
+  disk_sector_t parent = inode_get_inumber (dir->inode);
+  size_t read_cnt = 0;
+
+  while (read_cnt < cnt)
+  {
+    unsigned generation;
+    off_t bytes;
+    size_t i, entry_cnt;
+
+    /* taken before the entries are read, as dir_lookup() does, so
+       that an entry removed meanwhile is not cached */
+    generation = dcache_generation ();
+    bytes = inode_read_at (dir->inode, e, sizeof e, dir->pos);
+    entry_cnt = bytes / sizeof *e;
+    if (entry_cnt == 0)
+      break;
+
+    for (i = 0; i < entry_cnt && read_cnt < cnt; i++)
+    {
+      struct dirent *d = &entries[read_cnt];
+      disk_sector_t sector;
+      bool is_dir;
+
+      dir->pos += sizeof *e;
+      if (!e[i].in_use)
+	continue;
+
+      if (!dcache_lookup (parent, e[i].name, &sector, &is_dir)
+	  || sector != e[i].inode_sector)
+      {
+	struct inode *inode = inode_open (e[i].inode_sector);
+
+	if (inode == NULL)
+	  continue;
+	is_dir = inode_is_dir (inode);
+	inode_close (inode);
+	dcache_insert (parent, e[i].name, e[i].inode_sector, is_dir,
+		       generation);
+      }
+
+      strlcpy (d->name, e[i].name, sizeof d->name);
+      d->inumber = e[i].inode_sector;
+      d->is_dir = is_dir;
+      read_cnt++;
+    }
+  }
+  return read_cnt;
+}
+
 /* Get directory structure DIR that DIRFILE is located at 
  * if DIRFILE is /a/b/c, return directory structure of /a/b
  * if DIRFILE is /, return root
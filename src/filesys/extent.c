@@ -0,0 +1,376 @@
+#include "filesys/extent.h"
+#include <debug.h>
+#include <round.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
+
+/* number of extents in an extent block */
+#define EXTENT_BLOCK_NUM ((DISK_SECTOR_SIZE - 8) / sizeof (struct extent))
+
+/* on-disk extent block, exactly DISK_SECTOR_SIZE bytes long */
+struct extent_block
+{
+    disk_sector_t next;			/* next extent block, 0 if none */
+    uint32_t unused;
+    struct extent extents[EXTENT_BLOCK_NUM];
+};
+
+static disk_sector_t extent_block_sector (const struct extent_root *, size_t);
+static void extent_read (const struct extent_root *, size_t, struct extent *);
+static bool extent_write (struct extent_root *, size_t, const struct extent *);
+static void extent_drop_block (struct extent_root *, size_t);
+
+/* return the sector of extent block K of ROOT, 0 if it does not exist */
+static disk_sector_t extent_block_sector (const struct extent_root *root, size_t k)
+{
+    disk_sector_t sector = root->block;
+
+    while (k-- > 0 && sector != 0)
+    {
+	const struct extent_block *b = cache_get (sector, false);
+	disk_sector_t next = b->next;
+
+	cache_put ((void *) b, false);
+	sector = next;
+    }
+    return sector;
+}
+
+/* read extent IDX of ROOT into E */
+static void extent_read (const struct extent_root *root, size_t idx, struct extent *e)
+{
+    const struct extent_block *b;
+
+    ASSERT (idx < root->cnt);
+
+    if (idx < INODE_EXTENT_NUM)
+    {
+	*e = root->extents[idx];
+	return;
+    }
+
+    idx -= INODE_EXTENT_NUM;
+    b = cache_get (extent_block_sector (root, idx / EXTENT_BLOCK_NUM), false);
+    *e = b->extents[idx % EXTENT_BLOCK_NUM];
+    cache_put ((void *) b, false);
+}
+
+/* write E as extent IDX of ROOT, which is either an existing extent or
+ * the one past the last.  a new extent block is chained if needed.
+ * return false if no sector is left for an extent block */
+static bool extent_write (struct extent_root *root, size_t idx, const struct extent *e)
+{
+    struct extent_block *b;
+    disk_sector_t sector;
+    size_t k;
+
+    ASSERT (idx <= root->cnt);
+
+    if (idx < INODE_EXTENT_NUM)
+    {
+	root->extents[idx] = *e;
+	return true;
+    }
+
+    idx -= INODE_EXTENT_NUM;
+    k = idx / EXTENT_BLOCK_NUM;
+
+    /* the first extent of a new extent block */
+    if (idx % EXTENT_BLOCK_NUM == 0 && idx + INODE_EXTENT_NUM == root->cnt)
+    {
+	if (!free_map_allocate_near (e->start, 1, &sector))
+	    return false;
+	cache_zero (sector);
+
+	if (k == 0)
+	    root->block = sector;
+	else
+	{
+	    b = cache_get (extent_block_sector (root, k - 1), true);
+	    b->next = sector;
+	    cache_put (b, true);
+	}
+    }
+    else
+	sector = extent_block_sector (root, k);
+
+    b = cache_get (sector, true);
+    b->extents[idx % EXTENT_BLOCK_NUM] = *e;
+    cache_put (b, true);
+    return true;
+}
+
+/* release the extent block of ROOT which extent IDX, one past the last
+ * extent, is the first of, if there is one */
+static void extent_drop_block (struct extent_root *root, size_t idx)
+{
+    disk_sector_t sector;
+
+    ASSERT (idx == root->cnt);
+
+    if (idx < INODE_EXTENT_NUM || (idx - INODE_EXTENT_NUM) % EXTENT_BLOCK_NUM != 0)
+	return;
+
+    idx = (idx - INODE_EXTENT_NUM) / EXTENT_BLOCK_NUM;
+    sector = extent_block_sector (root, idx);
+    if (idx == 0)
+	root->block = 0;
+    else
+    {
+	struct extent_block *b = cache_get (extent_block_sector (root, idx - 1), true);
+
+	b->next = 0;
+	cache_put (b, true);
+    }
+    free_map_release (sector, 1);
+}
+
+/* return the sector mapped to sector index IDX by ROOT, 0 if IDX is in a
+ * hole, or -1 if IDX is beyond the mapped sectors.
+ * the lookup resumes from MEMO if it is before IDX, and MEMO is updated
+ * to the extent found.  if CNT is not NULL, the number of contiguous
+ * sectors from the returned one up to the end of its extent is stored
+ * into it. */
+disk_sector_t extent_lookup (const struct extent_root *root, size_t idx,
+	struct extent_memo *memo, size_t *cnt)
+{
+    struct extent e;
+    size_t i = 0, base = 0;
+
+    if (memo->idx < root->cnt && memo->base <= idx)
+    {
+	i = memo->idx;
+	base = memo->base;
+    }
+
+    for (; i < root->cnt; i++, base += e.length)
+    {
+	extent_read (root, i, &e);
+	if (idx < base + e.length)
+	{
+	    memo->idx = i;
+	    memo->base = base;
+	    if (cnt != NULL)
+		*cnt = base + e.length - idx;
+	    return e.start != 0 ? e.start + (idx - base) : 0;
+	}
+    }
+
+    return -1;
+}
+
+/* append SECTORS newly allocated sectors to ROOT.
+ * the last extent is extended in place while the sectors after it are
+ * free, otherwise the longest free run up to the number of sectors left
+ * is allocated as a new extent, as close past the last extent as
+ * possible, or past GOAL if there is none.
+ * if ZERO is true the new sectors are zeroed in the buffer cache, not on
+ * the disk, otherwise their contents are left as they are.
+ * return the number of sectors actually appended, which is less than
+ * SECTORS only if the disk is full */
+size_t extent_grow (struct extent_root *root, size_t sectors,
+	disk_sector_t goal, bool zero)
+{
+    size_t grown = 0;
+
+    while (grown < sectors)
+    {
+	size_t cnt = sectors - grown, i;
+	struct extent last;
+	disk_sector_t start;
+	bool merge = false;
+
+	if (root->cnt > 0)
+	{
+	    extent_read (root, root->cnt - 1, &last);
+	    if (last.start != 0)
+	    {
+		goal = last.start + last.length;
+		merge = free_map_allocate_at (goal, cnt);
+	    }
+	}
+
+	if (merge)
+	    start = last.start + last.length;
+	else if ((cnt = free_map_allocate_run (goal, cnt, &start)) == 0)
+	    return grown;
+
+	for (i = 0; zero && i < cnt; i++)
+	    cache_zero (start + i);
+
+	if (merge)
+	{
+	    last.length += cnt;
+	    extent_write (root, root->cnt - 1, &last);
+	}
+	else
+	{
+	    struct extent e = { start, cnt };
+
+	    if (!extent_write (root, root->cnt, &e))
+	    {
+		free_map_release (start, cnt);
+		return grown;
+	    }
+	    root->cnt++;
+	}
+	grown += cnt;
+    }
+
+    return grown;
+}
+
+/* release the last SECTORS sectors appended to ROOT by extent_grow (),
+ * dropping the extents and extent blocks they leave empty */
+void extent_shrink (struct extent_root *root, size_t sectors)
+{
+    while (sectors > 0)
+    {
+	struct extent e;
+	size_t cnt;
+
+	ASSERT (root->cnt > 0);
+	extent_read (root, root->cnt - 1, &e);
+	ASSERT (e.start != 0);
+
+	cnt = e.length < sectors ? e.length : sectors;
+	free_map_release (e.start + e.length - cnt, cnt);
+	e.length -= cnt;
+	sectors -= cnt;
+	if (e.length > 0)
+	{
+	    extent_write (root, root->cnt - 1, &e);
+	    continue;
+	}
+
+	/* the extent block of an extent which was first in it goes too */
+	root->cnt--;
+	extent_drop_block (root, root->cnt);
+    }
+}
+
+/* return the most extent blocks extent_grow () allocates to append
+ * SECTORS sectors, one for every EXTENT_BLOCK_NUM new extents of a
+ * sector each */
+size_t extent_grow_blocks (size_t sectors)
+{
+    return DIV_ROUND_UP (sectors, EXTENT_BLOCK_NUM);
+}
+
+/* append a hole of SECTORS sectors to ROOT.
+ * return false if no sector is left for an extent block */
+bool extent_add_hole (struct extent_root *root, size_t sectors)
+{
+    struct extent e;
+
+    if (root->cnt > 0)
+    {
+	extent_read (root, root->cnt - 1, &e);
+	if (e.start == 0)
+	{
+	    e.length += sectors;
+	    return extent_write (root, root->cnt - 1, &e);
+	}
+    }
+
+    e.start = 0;
+    e.length = sectors;
+    if (!extent_write (root, root->cnt, &e))
+	return false;
+    root->cnt++;
+    return true;
+}
+
+/* allocate zero-filled sectors for the CNT sectors from sector index IDX
+ * of ROOT, which must all be inside a single hole, as close past GOAL
+ * as possible.
+ * the hole extent is split into the hole before the new run, the run,
+ * and the hole after it, moving the extents after the hole up.
+ * return the number of sectors allocated from IDX, 0 if the disk is
+ * full.  extent memos into ROOT past the hole are stale afterwards */
+size_t extent_fill (struct extent_root *root, size_t idx, size_t cnt,
+	disk_sector_t goal)
+{
+    struct extent_memo memo = { 0, 0 };
+    struct extent hole, pieces[3], e;
+    disk_sector_t start;
+    size_t n = 0, added = 0, i;
+
+    extent_lookup (root, idx, &memo, NULL);
+    extent_read (root, memo.idx, &hole);
+    ASSERT (hole.start == 0 && idx + cnt <= memo.base + hole.length);
+
+    if ((cnt = free_map_allocate_run (goal, cnt, &start)) == 0)
+	return 0;
+    for (i = 0; i < cnt; i++)
+	cache_zero (start + i);
+
+    /* the hole before the run, the run, the hole after the run */
+    if (idx > memo.base)
+    {
+	pieces[n].start = 0;
+	pieces[n++].length = idx - memo.base;
+    }
+    pieces[n].start = start;
+    pieces[n++].length = cnt;
+    if (idx + cnt < memo.base + hole.length)
+    {
+	pieces[n].start = 0;
+	pieces[n++].length = memo.base + hole.length - idx - cnt;
+    }
+
+    /* make room for the pieces after the hole */
+    for (; added < n - 1; added++)
+    {
+	if (!extent_write (root, root->cnt, &hole))
+	{
+	    /* drop the extents added, and the extent blocks chained for
+	       them */
+	    for (; added > 0; added--)
+	    {
+		root->cnt--;
+		extent_drop_block (root, root->cnt);
+	    }
+	    free_map_release (start, cnt);
+	    return 0;
+	}
+	root->cnt++;
+    }
+    for (i = root->cnt - 1; added > 0 && i >= memo.idx + n; i--)
+    {
+	extent_read (root, i - added, &e);
+	extent_write (root, i, &e);
+    }
+    for (i = 0; i < n; i++)
+	extent_write (root, memo.idx + i, &pieces[i]);
+    return cnt;
+}
+
+/* release every sector mapped by ROOT and its extent blocks */
+void extent_release (struct extent_root *root)
+{
+    struct extent e;
+    disk_sector_t sector;
+    size_t i;
+
+    for (i = 0; i < root->cnt; i++)
+    {
+	extent_read (root, i, &e);
+	if (e.start != 0)
+	    free_map_release (e.start, e.length);
+    }
+
+    for (sector = root->block; sector != 0; )
+    {
+	const struct extent_block *b = cache_get (sector, false);
+	disk_sector_t next = b->next;
+
+	cache_put ((void *) b, false);
+	free_map_release (sector, 1);
+	sector = next;
+    }
+
+    root->cnt = 0;
+    root->block = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef FILESYS_EXTENT_H
+#define FILESYS_EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/disk.h"
+
+/* number of extents kept in an inode itself */
+#define INODE_EXTENT_NUM 7
+
+/* a run of LENGTH contiguous sectors starting at START.
+ * an extent starting at sector 0 is a hole, which reads as zeros and has
+ * no sector allocated */
+struct extent
+{
+    disk_sector_t start;
+    uint32_t length;
+};
+
+/* extent list kept in an on-disk inode.
+ * extents map consecutive sector indexes of a file, so the logical
+ * position of an extent is the sum of the lengths of the extents before
+ * it.  the first INODE_EXTENT_NUM extents are kept here, the rest spill
+ * into a chain of extent blocks starting at BLOCK. */
+struct extent_root
+{
+    uint32_t cnt;			/* number of extents */
+    disk_sector_t block;		/* first extent block, 0 if none */
+    struct extent extents[INODE_EXTENT_NUM];
+};
+
+/* position of the extent resolved last, to resume a lookup from */
+struct extent_memo
+{
+    size_t idx;				/* index of the extent */
+    size_t base;			/* sector index mapped by its first sector */
+};
+
+disk_sector_t extent_lookup (const struct extent_root *, size_t idx,
+	struct extent_memo *, size_t *cnt);
+size_t extent_grow (struct extent_root *, size_t sectors,
+	disk_sector_t goal, bool zero);
+void extent_shrink (struct extent_root *, size_t sectors);
+size_t extent_grow_blocks (size_t sectors);
+bool extent_add_hole (struct extent_root *, size_t sectors);
+size_t extent_fill (struct extent_root *, size_t idx, size_t cnt,
+	disk_sector_t goal);
+void extent_release (struct extent_root *);
+
+#endif /* filesys/extent.h */
@@ -144,6 +144,17 @@ file_allow_write (struct file *file)
     }
 }
 
+/* Reserves disk space for FILE to grow up to LENGTH bytes,
+   without changing its size.
+   Returns true if successful, false if the disk is full or
+   writes to FILE are denied. */
+bool
+file_allocate (struct file *file, off_t length) 
+{
+  ASSERT (file != NULL);
+  return inode_reserve (file->inode, length);
+}
+
 /* Returns the size of FILE in bytes. */
 off_t
 file_length (struct file *file) 
@@ -9,6 +9,7 @@
 #include "devices/disk.h"
 #include "threads/malloc.h"
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
 
 #define NAME_LEN_MAX 196
 
@@ -29,10 +30,13 @@ filesys_init (bool format)
     PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
   inode_init ();
+  dcache_init ();
   free_map_init ();
   init_cache ();
   if (format) 
     do_format ();
+  else
+    inode_use_extents = inode_has_extents (ROOT_DIR_SECTOR);
   lock_init(&create_lock);
 
   free_map_open ();
@@ -43,6 +47,7 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  inode_flush_delayed ();
   cache_to_disk (); 
   free_map_close ();
 }
@@ -59,13 +64,15 @@ filesys_create (const char *name, off_t initial_size)
   strlcpy (copy, name, namelen);
 
   disk_sector_t inode_sector = 0;
-  struct dir *dir = get_dir (name);
+  struct dir *dir;
   char *fname = get_name (copy);
   bool success = false;
   lock_acquire(&create_lock);
+  dir = get_dir (name);
   if (strcmp(fname, ".") && strcmp(fname, ".."))
       success = (dir != NULL
-	&& free_map_allocate (1, &inode_sector)
+	&& free_map_allocate_near (inode_get_inumber (dir_get_inode (dir)),
+				   1, &inode_sector)
 	&& inode_create (inode_sector, initial_size, false)
 	&& dir_add (dir, fname, inode_sector));
 
@@ -204,7 +211,8 @@ filesys_remove (const char *name)
 static void
 do_format (void)
 {
-  printf ("Formatting file system...");
+  printf ("Formatting file system%s...",
+	  inode_use_extents ? " with extents" : "");
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
@@ -243,18 +251,22 @@ bool filesys_create_dir (const char *name, off_t initial_size)
     strlcpy (copy, name, namelen);
 
     disk_sector_t inode_sector = 0;
-    struct dir *dir = get_dir (name);
+    struct dir *dir;
     char *fname = get_name (copy);
     bool success = false;
+    lock_acquire(&create_lock);
+    dir = get_dir (name);
     if (strcmp(fname, ".") && strcmp(fname, ".."))//create child directory
 	success = (dir != NULL
-		&& free_map_allocate (1, &inode_sector)
+		&& free_map_allocate_near (inode_get_inumber (dir_get_inode (dir)),
+					   1, &inode_sector)
 		&& inode_create (inode_sector, initial_size, true)
 		&& dir_add (dir, fname, inode_sector));
     if (!success && inode_sector != 0)//failure
 	free_map_release (inode_sector, 1);
 
     dir_close (dir);//close current directory
+    lock_release(&create_lock);
     free (copy);
     return success;
 }
@@ -1,12 +1,49 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Sectors in an allocation group.  The free sectors of each group
+   are counted, so a search skips full groups without looking at
+   their bits. */
+#define GROUP_SECTORS 1024
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
+static size_t free_cnt;              /* Number of free sectors. */
+static size_t reserved_cnt;          /* Free sectors promised by
+                                        free_map_reserve(). */
+static size_t *group_free;           /* Free sectors of each group. */
+static size_t group_cnt;             /* Number of groups. */
+static disk_sector_t next_fit;       /* Where a search without a goal
+                                        starts, just past the sectors
+                                        such a search allocated last. */
+static size_t draw_cnt;              /* Reserved sectors the holder of
+                                        draw_lock may still allocate. */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+/* Held by the one thread whose allocations come out of reserved
+   sectors, between free_map_begin_reserved() and
+   free_map_end_reserved(). */
+static struct lock draw_lock;
+
+/* Every change to the free map is written to the free map file
+   right away, but only the bitmap elements holding the changed bits
+   are, so an allocation dirties one or two of its sectors in the
+   buffer cache instead of all of them. */
+
+static size_t available (void);
+static bool allocate (disk_sector_t, size_t, disk_sector_t *);
+static void draw (size_t);
+static size_t search (size_t, size_t);
+static bool mark (disk_sector_t, size_t, bool);
+static void count_groups (void);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -14,37 +51,282 @@ free_map_init (void)
   free_map = bitmap_create (disk_size (filesys_disk));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--disk is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  group_free = calloc (group_cnt, sizeof *group_free);
+  if (group_free == NULL)
+    PANIC ("allocation group creation failed");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_groups ();
+  reserved_cnt = 0;
+  next_fit = 0;
+  draw_cnt = 0;
+  lock_init (&free_map_lock);
+  lock_init (&draw_lock);
+}
+
+/* Counts the free sectors of the free map and of each group. */
+static void
+count_groups (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t g;
+
+  free_cnt = 0;
+  for (g = 0; g < group_cnt; g++)
+    {
+      size_t start = g * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+
+      group_free[g] = bitmap_count (free_map, start, cnt, false);
+      free_cnt += group_free[g];
+    }
+}
+
+/* Returns the number of free sectors the current thread may
+   allocate: those not promised by free_map_reserve(), plus those
+   it draws on after free_map_begin_reserved().
+   free_map_lock must be held. */
+static size_t
+available (void)
+{
+  size_t cnt = free_cnt - reserved_cnt;
+
+  if (lock_held_by_current_thread (&draw_lock))
+    cnt += draw_cnt;
+  return cnt;
+}
+
+/* Takes CNT sectors just allocated out of the reserved sectors the
+   current thread draws on, as far as it has any.
+   free_map_lock must be held. */
+static void
+draw (size_t cnt)
+{
+  if (!lock_held_by_current_thread (&draw_lock))
+    return;
+  if (cnt > draw_cnt)
+    cnt = draw_cnt;
+  draw_cnt -= cnt;
+  reserved_cnt -= cnt;
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
+   The search goes on from where the last one without a goal ended.
+   Sectors promised by free_map_reserve() are not handed out, except
+   to the thread drawing on them.
    Returns true if successful, false if all sectors were
    available. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) 
 {
-  disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Allocates CNT consecutive sectors, the first free run at or past
+   GOAL, and stores the first into *SECTORP.  The search wraps
+   around to the start of the disk.  A GOAL of 0 means none, as in
+   free_map_allocate().
+   Returns true if successful, false if all sectors were
+   available. */
+bool
+free_map_allocate_near (disk_sector_t goal, size_t cnt,
+                        disk_sector_t *sectorp)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = allocate (goal, cnt, sectorp);
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Does the work of free_map_allocate_near() with free_map_lock
+   held. */
+static bool
+allocate (disk_sector_t goal, size_t cnt, disk_sector_t *sectorp)
+{
+  size_t sector;
+
+  if (cnt == 0 || cnt > available ())
+    return false;
+
+  sector = search (goal != 0 ? goal : next_fit, cnt);
+  if (sector == BITMAP_ERROR || !mark (sector, cnt, true))
+    return false;
+  draw (cnt);
+
+  if (goal == 0)
+    next_fit = sector + cnt;
+  *sectorp = sector;
+  return true;
+}
+
+/* Returns the first sector of the first run of CNT free sectors at
+   or past START, wrapping around to the start of the disk, or
+   BITMAP_ERROR if there is none.  Full groups are skipped. */
+static size_t
+search (size_t start, size_t cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t pos = start < size ? start : 0;
+  bool wrapped = false;
+
+  for (;;)
+    {
+      while (pos < size && group_free[pos / GROUP_SECTORS] == 0)
+        pos = (pos / GROUP_SECTORS + 1) * GROUP_SECTORS;
+
+      if (pos < size)
+        {
+          size_t sector = bitmap_scan (free_map, pos, cnt, false);
+          if (sector != BITMAP_ERROR)
+            return sector;
+        }
+
+      /* Runs before START are looked at last. */
+      if (wrapped || start == 0)
+        return BITMAP_ERROR;
+      wrapped = true;
+      pos = 0;
+    }
+}
+
+/* Marks the CNT sectors starting at SECTOR as used if USED is
+   true, as free otherwise, and writes the change to the free map
+   file.
+   Returns false, leaving the free map as it was, if it cannot be
+   written. */
+static bool
+mark (disk_sector_t sector, size_t cnt, bool used)
+{
+  size_t i;
+
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  if (free_map_file != NULL
+      && !bitmap_write_range (free_map, free_map_file, sector, cnt)
+      && used)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      return false;
+    }
+
+  for (i = sector; i < sector + cnt; i++)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      if (used)
+        group_free[i / GROUP_SECTORS]--;
+      else
+        group_free[i / GROUP_SECTORS]++;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  if (used)
+    free_cnt -= cnt;
+  else
+    free_cnt += cnt;
+  return true;
+}
+
+/* Allocates the longest run of consecutive sectors it finds at or
+   past GOAL, as free_map_allocate_near() does, up to CNT sectors,
+   and stores the first into *SECTORP.
+   The run asked for is halved until one fits.
+   Returns the number of sectors allocated, 0 if the disk is
+   full. */
+size_t
+free_map_allocate_run (disk_sector_t goal, size_t cnt,
+                       disk_sector_t *sectorp)
+{
+  lock_acquire (&free_map_lock);
+  while (cnt > 0 && !allocate (goal, cnt, sectorp))
+    cnt /= 2;
+  lock_release (&free_map_lock);
+  return cnt;
+}
+
+/* Allocates the CNT consecutive sectors starting at SECTOR, if
+   all of them are free.
+   Returns true if successful, false otherwise. */
+bool
+free_map_allocate_at (disk_sector_t sector, size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = sector + cnt <= bitmap_size (free_map)
+            && cnt <= available ()
+            && bitmap_none (free_map, sector, cnt)
+            && mark (sector, cnt, true);
+  if (success)
+    draw (cnt);
+  lock_release (&free_map_lock);
+  return success;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Promises CNT free sectors to a caller which allocates them
+   later, so that other allocations cannot use them up meanwhile.
+   The caller allocates them between free_map_begin_reserved() and
+   free_map_end_reserved(), or gives them back to
+   free_map_unreserve().
+   Returns true if successful, false if there are not enough free
+   sectors. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = cnt <= available ();
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Takes back CNT sectors promised by free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (cnt <= reserved_cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Lets the allocations of the current thread use CNT sectors it
+   was promised by free_map_reserve(), until free_map_end_reserved().
+   Each sector allocated meanwhile stops being reserved in the same
+   step, so no other allocation can take it in between.  One thread
+   draws on reserved sectors at a time, the others wait here. */
+void
+free_map_begin_reserved (size_t cnt)
+{
+  lock_acquire (&draw_lock);
+  lock_acquire (&free_map_lock);
+  ASSERT (cnt <= reserved_cnt);
+  draw_cnt = cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Ends free_map_begin_reserved(), giving back the reserved sectors
+   the current thread did not allocate. */
+void
+free_map_end_reserved (void)
+{
+  lock_acquire (&free_map_lock);
+  reserved_cnt -= draw_cnt;
+  draw_cnt = 0;
+  lock_release (&free_map_lock);
+  lock_release (&draw_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -56,6 +338,7 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_groups ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
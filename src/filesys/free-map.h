@@ -12,7 +12,16 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
+bool free_map_allocate_near (disk_sector_t goal, size_t,
+                             disk_sector_t *);
+bool free_map_allocate_at (disk_sector_t, size_t);
+size_t free_map_allocate_run (disk_sector_t goal, size_t,
+                              disk_sector_t *);
 void free_map_release (disk_sector_t, size_t);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
+void free_map_begin_reserved (size_t);
+void free_map_end_reserved (void);
 
 
 #endif /* filesys/free-map.h */
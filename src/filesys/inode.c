@@ -1,6 +1,7 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
+#include <stdio.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
@@ -8,9 +9,14 @@
 #include "threads/malloc.h"
 
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
+#include "filesys/extent.h"
 #include "threads/synch.h"
+#include "threads/interrupt.h"
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
+/* Identifies an inode whose data is mapped by extents. */
+#define EXTENT_INODE_MAGIC 0x494e4f45
 
 /* imbalanced design */
 #define DIRECT_PTR_NUM 12
@@ -18,10 +24,18 @@
 #define DOUBLE_INDIRECT_PTR_NUM 1
 #define BOOL_LEN 1
 #define TOTAL_PTR_NUM (DIRECT_PTR_NUM + INDIRECT_PTR_NUM + DOUBLE_INDIRECT_PTR_NUM)
-#define UNUSED_NUM (122 - TOTAL_PTR_NUM)
+#define UNUSED_NUM (121 - TOTAL_PTR_NUM)
+/* a regular file up to this many bytes keeps its data in the inode */
+#define INLINE_DATA_MAX (UNUSED_NUM * 4)
 #define INDIRECT_BLOCK_SIZE (DISK_SECTOR_SIZE / 4)
+#define MAX_SECTOR_NUM (DIRECT_PTR_NUM + INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE \
+			+ INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
 
-#define ERROR_ALLOC -1
+/* read ahead window grows up to this many sectors on sequential reads */
+#define READ_AHEAD_MAX 32
+
+/* delayed sectors of an inode at most, before they get disk sectors */
+#define DELAY_MAX 64
 
 /* for debugging */
 #define OLD 0
@@ -36,8 +50,18 @@ struct inode_disk
     off_t double_indirect_idx;		/*number of sectors by double indirect blocks */
     unsigned magic;
     bool is_dir;			/*TRUE if inode is directory, FALSE if file*/
-    disk_sector_t directory [TOTAL_PTR_NUM]; /*an array which contains direct, indirect, double indirect blocks similar to a imbalanced tree*/
-    uint32_t unused[UNUSED_NUM];
+    bool is_inline;			/*TRUE if the data is in inline_data, not in sectors */
+    union
+    {
+      disk_sector_t directory [TOTAL_PTR_NUM]; /*an array which contains direct, indirect, double indirect blocks similar to a imbalanced tree*/
+      struct extent_root extents;	/*runs of sectors, if magic is EXTENT_INODE_MAGIC */
+    };
+    uint32_t reserved_sectors;		/*sectors mapped past the end by inode_reserve () */
+    union
+    {
+      uint8_t inline_data[INLINE_DATA_MAX];	/*data of an inline file, unused otherwise */
+      disk_sector_t dir_index;		/*hashed index of a directory, 0 if none */
+    };
 };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -48,41 +72,152 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, DISK_SECTOR_SIZE);
 }
 
-static bool inode_allocate (size_t, struct inode_disk *);
-static int indirect_allocate (size_t, disk_sector_t);
-static int double_indirect_allocate (size_t, disk_sector_t);
+static disk_sector_t lookup_sector (const struct inode_disk *, size_t);
+static size_t inode_fill (struct inode_disk *, size_t, size_t,
+			  disk_sector_t, bool);
 static void inode_deallocate (struct inode_disk *);
-static void indirect_deallocate (disk_sector_t, size_t);
-static void double_indirect_deallocate (disk_sector_t, size_t, size_t);
-static off_t expand_file (struct inode *, off_t);
+static void indirect_deallocate (disk_sector_t);
+static void double_indirect_deallocate (disk_sector_t);
+static off_t expand_map (struct inode_disk *, disk_sector_t, off_t, off_t);
+static void expand_file (struct inode *, off_t, off_t);
+static void inode_read_ahead (struct inode *, off_t, off_t);
+static off_t inode_load_run (struct inode *, off_t, off_t, disk_sector_t);
+static off_t inline_write (struct inode *, const void *, off_t, off_t);
+static bool inode_uninline (struct inode *);
+static bool inode_delay (struct inode *, off_t, off_t);
+static void inode_resolve_delayed (struct inode *);
+static void inode_discard_delayed (struct inode *);
+static void delayed_copy (struct inode *, off_t, void *, int, int, bool);
+static size_t grow_needs (const struct inode_disk *, size_t);
+static void unmap_sectors (struct inode_disk *, size_t, size_t);
+
+/* True if inodes are created with an extent list instead of
+   direct and indirect blocks.  Chosen when the disk is formatted. */
+bool inode_use_extents;
 
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     disk_sector_t sector;               /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     off_t readable_length;		/* length of a file which is readable excluding being expanded parts */
+    struct lock growth_lock;		/* held by a write extending the file until it commits */
+    struct rwlock map_lock;		/* protects the sector map in DATA */
+    off_t memo_base;			/* first sector index mapped by memo_block, -1 if none */
+    disk_sector_t memo_block;		/* indirect block resolved last by byte_to_sector */
+    off_t ra_last;			/* index of the sector read last, -1 if none */
+    off_t ra_end;			/* read ahead is queued up to this sector index */
+    int ra_window;			/* number of sectors to read ahead */
+    struct extent_memo extent_memo;	/* extent resolved last by byte_to_sector */
+    off_t delay_start;			/* sector index of the first delayed sector */
+    disk_sector_t delay_base;		/* delayed sector number of delay_start */
+    size_t delay_cnt;			/* number of delayed sectors, 0 if none */
+    size_t delay_reserved;		/* free map sectors reserved for them */
+    struct lock dir_lock;		/* held while the entries of a directory change */
+    struct inode *dir_index;		/* hashed index of a directory once opened, or null */
     struct inode_disk data;             /* Inode content. */
     struct inode *parent_inode;
   };
 
+/* Delayed allocation.  A write past the end of a regular file does
+   not allocate the sectors it adds, it only reserves them in the free
+   map.  They are kept in the buffer cache as delayed sectors, which
+   follow the sectors in the map of the file, until all of them get
+   disk sectors at once: when the write behind thread runs, the file
+   is closed, or too many sectors are delayed.  Small appends to a
+   file thus end up in a single run of sectors.
+   The reservation also covers the indirect or extent blocks the
+   sectors may need, so they always get disk sectors in the end.
+   DELAY_LOCK protects the counters below. */
+static struct lock delay_lock;
+static size_t delayed_total;            /* Delayed sectors of all inodes. */
+static disk_sector_t next_delayed = CACHE_DELAYED_BASE;
+                                        /* Next DELAY_MAX delayed sector
+                                           numbers to hand out. */
+
+/* Returns true if SECTOR is a delayed sector, which has no disk
+   sector yet. */
+static inline bool
+is_delayed (disk_sector_t sector)
+{
+  return sector >= CACHE_DELAYED_BASE && sector != (disk_sector_t) -1;
+}
+
+/* Returns entry IDX of indirect block BLOCK, read in place in the
+   buffer cache. */
+static disk_sector_t
+indirect_entry (disk_sector_t block, off_t idx)
+{
+  const disk_sector_t *entries = cache_get (block, false);
+  disk_sector_t sector = entries[idx];
+
+  cache_put ((void *) entries, false);
+  return sector;
+}
+
+/* Returns true if the data of DISK_INODE is mapped by extents. */
+static inline bool
+has_extents (const struct inode_disk *disk_inode)
+{
+  return disk_inode->magic == EXTENT_INODE_MAGIC;
+}
+
+/* Returns the disk sector of sector index IDX within INODE, whose
+   data is mapped by extents.  The search resumes from the extent
+   found last, so a sequential access walks each extent once. */
+static disk_sector_t
+extent_to_sector (struct inode *inode, size_t idx)
+{
+  struct extent_memo memo;
+  disk_sector_t sector;
+  enum intr_level old_level;
+
+  old_level = intr_disable ();
+  memo = inode->extent_memo;
+  intr_set_level (old_level);
+
+  sector = extent_lookup (&inode->data.extents, idx, &memo, NULL);
+
+  old_level = intr_disable ();
+  inode->extent_memo = memo;
+  intr_set_level (old_level);
+
+  return sector;
+}
+
 /* Returns the disk sector that contains byte offset POS within
-   INODE.
+   INODE, or its delayed sector.
+   Returns 0 if POS is in a hole, which has no sector yet.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 /* team10
  * impl indirected block based calculation
- */
+ * indirect blocks are read through the buffer cache, and the last
+ * indirect block holding data pointers is remembered in INODE, so
+ * consecutive sectors need neither the double indirect block nor I/O
+ * the map lock of INODE must be held */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+map_sector (struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
+  if (inode->data.is_inline)
+    return 0;
   if (pos < inode->data.length)
   {
     int idx = pos / DISK_SECTOR_SIZE;
+    off_t base;
+    disk_sector_t block;
+    enum intr_level old_level;
+
+    /* delayed sectors are not in the map yet */
+    if (inode->delay_cnt > 0 && idx >= inode->delay_start)
+      return inode->delay_base + (idx - inode->delay_start);
+
+    if (has_extents (&inode->data))
+      return extent_to_sector (inode, idx);
 
     /* pos is inside a direct block */
     if (idx < DIRECT_PTR_NUM)
@@ -90,48 +225,113 @@ byte_to_sector (const struct inode *inode, off_t pos)
       return inode->data.directory[idx];
     }
 
+    /* pos is inside the memoized indirect block */
+    old_level = intr_disable ();
+    base = inode->memo_base;
+    block = inode->memo_block;
+    intr_set_level (old_level);
+
+    if (base >= 0 && idx >= base && idx < base + INDIRECT_BLOCK_SIZE)
+      return indirect_entry (block, idx - base);
+
     idx -= DIRECT_PTR_NUM;
 
     /* pos is inside a indirect block */
     if (idx < INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE)
     {
-      disk_sector_t block [INDIRECT_BLOCK_SIZE];
-      disk_read (filesys_disk, inode->data.directory[idx / INDIRECT_BLOCK_SIZE + DIRECT_PTR_NUM], block);
-
-      return block[idx % INDIRECT_BLOCK_SIZE];
+      block = inode->data.directory[idx / INDIRECT_BLOCK_SIZE + DIRECT_PTR_NUM];
+      base = DIRECT_PTR_NUM + idx / INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE;
+      if (block == 0)
+	return 0;
     }
-
-    idx -= INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE;
-
-    /* pos is inside a double indirect block */
-    if (idx < INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
+    else
     {
-      disk_sector_t block [INDIRECT_BLOCK_SIZE];
-
-      disk_read (filesys_disk, inode->data.directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM], block);
-      disk_read (filesys_disk, block[idx / INDIRECT_BLOCK_SIZE], block);
-
-      return block[idx % INDIRECT_BLOCK_SIZE];
+      idx -= INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE;
+
+      /* invalid pos */
+      if (idx >= INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
+	return -1;
+
+      /* pos is inside a double indirect block */
+      block = inode->data.directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM];
+      if (block == 0)
+	return 0;
+      block = indirect_entry (block, idx / INDIRECT_BLOCK_SIZE);
+      base = DIRECT_PTR_NUM + INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE
+	     + idx / INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE;
+      if (block == 0)
+	return 0;
     }
 
-    /* invalid pos */
-    return -1;
+    old_level = intr_disable ();
+    inode->memo_base = base;
+    inode->memo_block = block;
+    intr_set_level (old_level);
+
+    return indirect_entry (block, pos / DISK_SECTOR_SIZE - base);
   }
   else
     return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
-static struct lock file_growth_lock;
+/* Returns the disk sector that contains byte offset POS within
+   INODE, as map_sector() does.  The map lock is held for reading
+   only during the lookup, so readers wait for a writer just while it
+   changes the sector map, never while it copies data. */
+static disk_sector_t
+byte_to_sector (struct inode *inode, off_t pos)
+{
+  disk_sector_t sector;
+
+  rwlock_acquire_read (&inode->map_lock);
+  sector = map_sector (inode, pos);
+  rwlock_release_read (&inode->map_lock);
+  return sector;
+}
+
+/* Open inodes indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  OPEN_INODES_LOCK protects
+   it, the open counts of its inodes and the counters below. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+static size_t open_inodes_max;          /* Most inodes open at once. */
+
+static unsigned inode_hash_func (const struct hash_elem *, void *);
+static bool inode_less_func (const struct hash_elem *,
+                             const struct hash_elem *, void *);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
-  lock_init (&file_growth_lock);
+  if (!hash_init (&open_inodes, inode_hash_func, inode_less_func, NULL))
+    PANIC ("open inode table creation failed");
+  lock_init (&open_inodes_lock);
+  lock_init (&delay_lock);
+}
+
+/* Hash function of open_inodes: an inode is hashed by its sector. */
+static unsigned
+inode_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Comparison function of open_inodes. */
+static bool
+inode_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  return hash_entry (a, struct inode, elem)->sector
+         < hash_entry (b, struct inode, elem)->sector;
+}
+
+/* Prints the number of open inodes. */
+void
+inode_print_stats (void)
+{
+  printf ("Inodes: %zu open, %zu open at most\n",
+          hash_size (&open_inodes), open_inodes_max);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -156,15 +356,25 @@ inode_create (disk_sector_t sector, off_t length, bool is_dir)
   {
       size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
+      disk_inode->magic = inode_use_extents ? EXTENT_INODE_MAGIC : INODE_MAGIC;
       disk_inode->is_dir = is_dir;
 
+      /* a small file is stored in the inode itself, a directory never
+	 is, because lookups read its entries in place in the cache */
+      if (!is_dir && length <= INLINE_DATA_MAX)
+      {
+	disk_inode->is_inline = true;
+	write_cache (sector, disk_inode, DISK_SECTOR_SIZE, 0);
+	success = true;
+      }
       /* allocate sectors amount memory */
-      if (inode_allocate (sectors, disk_inode))
+      else if (inode_fill (disk_inode, 0, sectors, sector, true) == sectors)
       {
-	disk_write (filesys_disk, sector, disk_inode);
+	write_cache (sector, disk_inode, DISK_SECTOR_SIZE, 0);
 	success = true;
       }
+      else
+	inode_deallocate (disk_inode);
 
       free (disk_inode);
   }
@@ -177,35 +387,55 @@ inode_create (disk_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (disk_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
 
+  lock_acquire (&open_inodes_lock);
+
   /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-      e = list_next (e)) 
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  if (e != NULL)
   {
-    inode = list_entry (e, struct inode, elem);
-    if (inode->sector == sector) 
-    {
-      inode_reopen (inode);
-      return inode; 
-    }
+    inode = hash_entry (e, struct inode, elem);
+    inode->open_cnt++;
+    lock_release (&open_inodes_lock);
+    return inode; 
   }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
+  {
+    lock_release (&open_inodes_lock);
     return NULL;
+  }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
   inode->parent_inode = NULL;
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  disk_read (filesys_disk, inode->sector, &inode->data);
+  inode->memo_base = -1;
+  inode->ra_last = -1;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  inode->extent_memo.idx = 0;
+  inode->extent_memo.base = 0;
+  inode->delay_cnt = 0;
+  inode->delay_reserved = 0;
+  inode->dir_index = NULL;
+  lock_init (&inode->dir_lock);
+  lock_init (&inode->growth_lock);
+  rwlock_init (&inode->map_lock);
+  read_cache (inode->sector, &inode->data, DISK_SECTOR_SIZE, 0);
   inode->readable_length = inode->data.length;
+  hash_insert (&open_inodes, &inode->elem);
+  if (hash_size (&open_inodes) > open_inodes_max)
+    open_inodes_max = hash_size (&open_inodes);
+  lock_release (&open_inodes_lock);
   //printf("    INODE_OPEN: INODE %d DENY %d\n", inode, inode->deny_write_cnt);
   return inode;
 }
@@ -215,7 +445,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
     if (inode != NULL)
+    {
+	lock_acquire (&open_inodes_lock);
 	inode->open_cnt++;
+	lock_release (&open_inodes_lock);
+    }
     return inode;
 }
 
@@ -237,24 +471,65 @@ inode_close (struct inode *inode)
     return;
 
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&open_inodes_lock);
+  if (--inode->open_cnt > 0)
   {
-    /* Remove from inode list and release lock. */
-    list_remove (&inode->elem);
+    lock_release (&open_inodes_lock);
+    return;
+  }
 
-    /* Deallocate blocks if removed. */
-    if (inode->removed) 
-    {
-      inode_deallocate (&inode->data);
-      free_map_release (inode->sector, 1);
-    }
-    else
+  /* a file is closed but it is remained in a directory, its delayed
+     sectors get disk sectors while it is still in the table, so that
+     whoever opens it again meanwhile finds them in its inode */
+  while (!inode->removed && inode->delay_cnt > 0)
+  {
+    inode->open_cnt++;
+    lock_release (&open_inodes_lock);
+
+    lock_acquire (&inode->growth_lock);
+    rwlock_acquire_write (&inode->map_lock);
+    inode_resolve_delayed (inode);
+    rwlock_release_write (&inode->map_lock);
+    lock_release (&inode->growth_lock);
+
+    lock_acquire (&open_inodes_lock);
+    if (--inode->open_cnt > 0)
     {
-      /* a file is closed but it is remained in a directory */ 
+      lock_release (&open_inodes_lock);
+      return;
     }
+  }
 
-    free (inode); 
+  /* Remove from inode table and release lock. */
+  hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  /* the index of a directory goes with it if it is removed */
+  if (inode->removed && inode->dir_index == NULL
+      && inode->data.is_dir && inode->data.dir_index != 0)
+    inode->dir_index = inode_open (inode->data.dir_index);
+  if (inode->dir_index != NULL)
+  {
+    if (inode->removed)
+      inode_remove (inode->dir_index);
+    inode_close (inode->dir_index);
+  }
+
+  /* Deallocate blocks if removed. */
+  if (inode->removed) 
+  {
+    inode_discard_delayed (inode);
+    inode_deallocate (&inode->data);
+
+    /* names cached under a directory are forgotten only now, since
+       they may be added back while it is open, and its sector may
+       hold another directory once released */
+    if (inode->data.is_dir)
+      dcache_invalidate_dir (inode->sector);
+    free_map_release (inode->sector, 1);
   }
+
+  free (inode); 
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -275,6 +550,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
   uint8_t *bounce = NULL;
+  off_t loaded_end = 0;
 
   /* offest is bigger than file length, read nothing */
   if (inode->readable_length <= offset)
@@ -287,6 +563,18 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       size -= (offset + size - inode->readable_length);
   }
 
+  /* the data of an inline file is in the inode itself */
+  if (inode->data.is_inline)
+  {
+    rwlock_acquire_read (&inode->map_lock);
+    if (inode->data.is_inline)
+    {
+      memcpy (buffer, inode->data.inline_data + offset, size);
+      bytes_read = size;
+      size = 0;
+    }
+    rwlock_release_read (&inode->map_lock);
+  }
 
   while (size > 0) 
   {
@@ -304,8 +592,21 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     if (chunk_size <= 0)
 	break;
 
-    /* read using a buffer cache */
-    read_cache (sector_idx, buffer + bytes_read, chunk_size, sector_ofs);
+    /* load the sectors left to read by runs of consecutive sectors */
+    if (sector_idx != 0 && !is_delayed (sector_idx)
+	&& offset / DISK_SECTOR_SIZE >= loaded_end)
+      loaded_end = offset / DISK_SECTOR_SIZE
+	+ inode_load_run (inode, offset / DISK_SECTOR_SIZE,
+			  (offset + size - 1) / DISK_SECTOR_SIZE, sector_idx);
+
+    /* a hole reads as zeros, otherwise read using a buffer cache */
+    if (sector_idx == 0)
+      memset (buffer + bytes_read, 0, chunk_size);
+    else if (is_delayed (sector_idx))
+      delayed_copy (inode, offset, buffer + bytes_read, chunk_size,
+		    sector_ofs, false);
+    else
+      read_cache (sector_idx, buffer + bytes_read, chunk_size, sector_ofs);
 
     /* Advance. */
     size -= chunk_size;
@@ -313,15 +614,186 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
     bytes_read += chunk_size;
   }
 
+  if (bytes_read > 0)
+    inode_read_ahead (inode, offset - bytes_read, offset);
+
   free (bounce);
   return bytes_read;
 }
 
+/* Writes SIZE bytes from BUFFER into INODE, whose data is inline,
+   starting at OFFSET.  If the data would not fit any more, it is
+   moved to a data sector instead.
+   Returns the number of bytes written, or -1 if INODE is not inline
+   any more and the write has to go through its sectors. */
+static off_t
+inline_write (struct inode *inode, const void *buffer, off_t size,
+	      off_t offset)
+{
+  off_t bytes_written = -1;
+
+  lock_acquire (&inode->growth_lock);
+  rwlock_acquire_write (&inode->map_lock);
+
+  if (!inode->data.is_inline)
+    ;
+  else if (offset + size <= INLINE_DATA_MAX)
+  {
+    memcpy (inode->data.inline_data + offset, buffer, size);
+    if (inode->data.length < offset + size)
+      inode->data.length = offset + size;
+    write_cache (inode->sector, &inode->data, DISK_SECTOR_SIZE, 0);
+    inode->readable_length = inode->data.length;
+    bytes_written = size;
+  }
+  else if (!inode_uninline (inode))
+    bytes_written = 0;
+
+  rwlock_release_write (&inode->map_lock);
+  lock_release (&inode->growth_lock);
+  return bytes_written;
+}
+
+/* Moves the inline data of INODE to a newly allocated sector, so
+   that it can grow past INLINE_DATA_MAX bytes.
+   The growth lock and the map lock of INODE must be held.
+   Returns false if the disk is full, leaving INODE inline. */
+static bool
+inode_uninline (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  uint8_t data[INLINE_DATA_MAX];
+  struct extent_memo memo = {0, 0};
+  disk_sector_t sector;
+
+  ASSERT (disk_inode->is_inline);
+
+  memcpy (data, disk_inode->inline_data, INLINE_DATA_MAX);
+  memset (disk_inode->inline_data, 0, INLINE_DATA_MAX);
+  disk_inode->is_inline = false;
+
+  if (inode_fill (disk_inode, 0, bytes_to_sectors (disk_inode->length),
+		  inode->sector, true)
+      < bytes_to_sectors (disk_inode->length))
+  {
+    memcpy (disk_inode->inline_data, data, INLINE_DATA_MAX);
+    disk_inode->is_inline = true;
+    return false;
+  }
+
+  if (disk_inode->length > 0)
+  {
+    sector = has_extents (disk_inode)
+      ? extent_lookup (&disk_inode->extents, 0, &memo, NULL)
+      : lookup_sector (disk_inode, 0);
+    write_cache (sector, data, disk_inode->length, 0);
+  }
+  write_cache (inode->sector, disk_inode, DISK_SECTOR_SIZE, 0);
+  return true;
+}
+
+/* Loads sector indexes IDX up to LAST of INODE into the buffer
+   cache, as far as they are consecutive on the disk from SECTOR,
+   the disk sector of IDX, with as few disk requests as possible.
+   Returns the number of sector indexes covered from IDX. */
+static off_t
+inode_load_run (struct inode *inode, off_t idx, off_t last,
+		disk_sector_t sector)
+{
+  off_t cnt = 1;
+
+  while (idx + cnt <= last && cnt < CACHE_RUN_MAX
+	 && byte_to_sector (inode, (idx + cnt) * DISK_SECTOR_SIZE) == sector + cnt)
+    cnt++;
+
+  /* a single sector is loaded by read_cache () itself */
+  if (cnt == 1)
+    return 1;
+  return cache_load_run (sector, cnt, false);
+}
+
+/* Detects a sequential stream of reads on INODE, given that bytes
+   from START up to END were just read, and queues the next sectors
+   of the file to be read ahead.
+   The window doubles each time a read moves on to the next sector,
+   up to READ_AHEAD_MAX, and drops to zero on a random access. */
+static void
+inode_read_ahead (struct inode *inode, off_t start, off_t end)
+{
+  off_t first = start / DISK_SECTOR_SIZE;
+  off_t last = (end - 1) / DISK_SECTOR_SIZE;
+  off_t sectors = bytes_to_sectors (inode->readable_length);
+  int window_max = READ_AHEAD_MAX;
+  off_t idx;
+
+  /* never read ahead more than a quarter of the buffer cache */
+  if ((size_t) window_max > buf_cache_size / 4)
+    window_max = buf_cache_size / 4;
+
+  if (first == inode->ra_last + 1)
+  {
+    inode->ra_window = inode->ra_window == 0 ? 1 : inode->ra_window * 2;
+    if (inode->ra_window > window_max)
+      inode->ra_window = window_max;
+  }
+  else if (first != inode->ra_last)
+  {
+    inode->ra_window = 0;
+    inode->ra_end = 0;
+  }
+  inode->ra_last = last;
+
+  /* queue sectors which are not queued yet */
+  idx = inode->ra_end > last + 1 ? inode->ra_end : last + 1;
+  for (; idx <= last + inode->ra_window && idx < sectors; idx++)
+  {
+    disk_sector_t sector = byte_to_sector (inode, idx * DISK_SECTOR_SIZE);
+
+    if (sector != 0 && sector != (disk_sector_t) -1)
+      cache_read_ahead (sector);
+  }
+  inode->ra_end = idx;
+}
+
+/* Returns the buffer cache copy of the sector of INODE that holds
+   byte OFFSET, without copying it.  The sector stays pinned in the
+   cache, and locked against writes through inode_write_at(), until
+   it is handed back to inode_put_block().  The caller must not get
+   another block before it puts this one back.
+   Returns a null pointer if OFFSET is beyond the end of INODE or in
+   a hole. */
+const void *
+inode_get_block (struct inode *inode, off_t offset)
+{
+  disk_sector_t sector;
+  const void *block;
+
+  if (offset < 0 || offset >= inode_length (inode))
+    return NULL;
+
+  sector = byte_to_sector (inode, offset);
+  if (sector == 0)
+    return NULL;
+
+  block = cache_get (sector, false);
+  cache_lock_data (block);
+  return block;
+}
+
+/* Releases BLOCK returned by inode_get_block(). */
+void
+inode_put_block (const void *block)
+{
+  cache_unlock_data (block);
+  cache_put ((void *) block, false);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   A write past the end of INODE extends it.  Extending writes to
+   one inode are serialized by its growth lock, which is held until
+   the data is written and the new length is committed to readers. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     off_t offset) 
@@ -329,16 +801,41 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
   uint8_t *bounce = NULL;
+  bool extending = false;
   if (inode->deny_write_cnt)
     return 0;
 
+  if (inode->data.is_inline)
+  {
+    bytes_written = inline_write (inode, buffer, size, offset);
+    if (bytes_written >= 0)
+      return bytes_written;
+    bytes_written = 0;
+  }
+
   /* offset + size is bigger than file length, expand a file */
   if (inode->data.length < offset + size)
   {
-    lock_acquire (&file_growth_lock);
-    inode->data.length = expand_file (inode, offset + size);
-    disk_write (filesys_disk, inode->sector, &inode->data);
-    lock_release (&file_growth_lock);
+    lock_acquire (&inode->growth_lock);
+    if (inode->data.length < offset + size)
+    {
+      bool delayed;
+
+      extending = true;
+      rwlock_acquire_write (&inode->map_lock);
+      delayed = inode_delay (inode, offset, offset + size);
+      if (!delayed)
+	inode_resolve_delayed (inode);
+      rwlock_release_write (&inode->map_lock);
+
+      if (!delayed)
+      {
+	expand_file (inode, offset, offset + size);
+	write_cache (inode->sector, &inode->data, DISK_SECTOR_SIZE, 0);
+      }
+    }
+    else
+      lock_release (&inode->growth_lock);
   }
 
   while (size > 0) 
@@ -357,8 +854,34 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     if (chunk_size <= 0)
       break;
 
+    /* a hole gets its sectors when it is written first */
+    if (sector_idx == 0)
+    {
+      if (!extending)
+	lock_acquire (&inode->growth_lock);
+      rwlock_acquire_write (&inode->map_lock);
+      inode_fill (&inode->data, offset / DISK_SECTOR_SIZE,
+		  bytes_to_sectors (offset + size), inode->sector, true);
+      write_cache (inode->sector, &inode->data, DISK_SECTOR_SIZE, 0);
+
+      /* filling a hole moves the extents after it */
+      inode->extent_memo.idx = 0;
+      inode->extent_memo.base = 0;
+      rwlock_release_write (&inode->map_lock);
+      if (!extending)
+	lock_release (&inode->growth_lock);
+
+      sector_idx = byte_to_sector (inode, offset);
+      if (sector_idx == 0)
+	break;
+    }
+
     /* write into a file using a buffer cache */
-    write_cache (sector_idx, (void *)(buffer + bytes_written), chunk_size, sector_ofs);
+    if (is_delayed (sector_idx))
+      delayed_copy (inode, offset, (void *)(buffer + bytes_written),
+		    chunk_size, sector_ofs, true);
+    else
+      write_cache (sector_idx, (void *)(buffer + bytes_written), chunk_size, sector_ofs);
 
     /* Advance. */
     size -= chunk_size;
@@ -366,7 +889,13 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
     bytes_written += chunk_size;
   }
   free (bounce);
-  inode->readable_length = inode->data.length;
+
+  /* commit the new length, readers see the written data from now on */
+  if (extending)
+  {
+    inode->readable_length = inode->data.length;
+    lock_release (&inode->growth_lock);
+  }
 
   return bytes_written;
 }
@@ -404,353 +933,787 @@ inode_cnt (const struct inode *inode)
   return inode->deny_write_cnt;
 }
 
-/* allocate sectors amount memory */
-static bool inode_allocate (size_t sectors, struct inode_disk *disk_inode)
-{
-  disk_inode->direct_idx = 0;
-  disk_inode->indirect_idx = 0;
-  disk_inode->double_indirect_idx = 0;
-
-  int iter = 0;
-
-  while (sectors > 0)
+/* An indirect block kept pinned in the buffer cache while a run of
+   its entries is filled in. */
+struct pinned_block
   {
-    /* allocate by direct blocks */
-    if (iter < DIRECT_PTR_NUM)
-    {
-      if (free_map_allocate (1, &disk_inode->directory[iter]))
-      {
-	sectors --;
-	disk_inode->direct_idx++;
-      }
-      else
-	goto error;
-    }
+    disk_sector_t sector;               /* Sector of the block, 0 if none. */
+    disk_sector_t *entries;             /* Its entries in the cache. */
+  };
 
-    /* allocate by indirect blocks */
-    else if (iter < DIRECT_PTR_NUM + INDIRECT_PTR_NUM)
-    {
-      if (free_map_allocate (1, &disk_inode->directory[iter]))
-      {	
-	int idx = indirect_allocate (sectors, disk_inode->directory[iter]);
-	if (idx == ERROR_ALLOC)
-	  goto error;
-	else
-	{
-	  sectors -= idx;
-	  disk_inode->indirect_idx += idx;
-	}
-      }
-    }
+/* Releases the indirect block held by PB, if any. */
+static void
+unpin_block (struct pinned_block *pb)
+{
+  if (pb->sector != 0)
+    cache_put (pb->entries, true);
+  pb->sector = 0;
+}
 
-    /* allocate by double indirect blocks */
-    else if (iter < DIRECT_PTR_NUM + INDIRECT_PTR_NUM + DOUBLE_INDIRECT_PTR_NUM)
-    {
-      if (free_map_allocate (1, &disk_inode->directory[iter]))
-      {
-	int idx = double_indirect_allocate (sectors, disk_inode->directory[iter]);
+/* Returns the entries of indirect block SECTOR for writing, keeping
+   the block pinned in PB until another block is asked for. */
+static disk_sector_t *
+pin_block (struct pinned_block *pb, disk_sector_t sector)
+{
+  if (pb->sector != sector)
+  {
+    unpin_block (pb);
+    pb->entries = cache_get (sector, true);
+    pb->sector = sector;
+  }
+  return pb->entries;
+}
 
-	if (idx == ERROR_ALLOC)
-	  goto error;
-	else
-	{
-	  sectors -= idx;
-	  disk_inode->double_indirect_idx += idx;
-	}
+/* Allocates an indirect block filled with zeros into *SECTORP, as
+   close past GOAL as the free map allows. */
+static bool
+allocate_block (disk_sector_t goal, disk_sector_t *sectorp)
+{
+  if (!free_map_allocate_near (goal, 1, sectorp))
+    return false;
+  cache_zero (*sectorp);
+  return true;
+}
 
-      }
-    }
+/* Returns the sector mapped at sector index IDX of DISK_INODE,
+   whose data is mapped by direct and indirect blocks, or 0 if IDX
+   is in a hole. */
+static disk_sector_t
+lookup_sector (const struct inode_disk *disk_inode, size_t idx)
+{
+  disk_sector_t block;
 
-    /* sectors is bigger than a disk size */
-    else{
-      PANIC ("Memory full!");
-    }
+  if (idx < DIRECT_PTR_NUM)
+    return disk_inode->directory[idx];
 
-    iter++;
+  idx -= DIRECT_PTR_NUM;
+  if (idx < INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE)
+  {
+    block = disk_inode->directory[DIRECT_PTR_NUM + idx / INDIRECT_BLOCK_SIZE];
+    return block != 0 ? indirect_entry (block, idx % INDIRECT_BLOCK_SIZE) : 0;
   }
 
-  return true;
+  idx -= INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE;
+  block = disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM];
+  if (block == 0 || idx >= INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
+    return 0;
 
-error:
-  /* dealloc all blocks */
-  return false;
+  block = indirect_entry (block, idx / INDIRECT_BLOCK_SIZE);
+  return block != 0 ? indirect_entry (block, idx % INDIRECT_BLOCK_SIZE) : 0;
 }
 
-/* allocate memory by a indirect block */
-static int indirect_allocate (size_t sectors, disk_sector_t indirect_block)
+/* Maps sector index IDX of DISK_INODE, which must be a hole, to
+   SECTOR, allocating the indirect blocks on the way, next to SECTOR.  The indirect
+   block written last stays pinned in PB.
+   Returns false if IDX is beyond the largest file or no sector is
+   left for an indirect block. */
+static bool
+set_sector (struct inode_disk *disk_inode, size_t idx,
+	    disk_sector_t sector, struct pinned_block *pb)
 {
-  static char zeros[DISK_SECTOR_SIZE] = {0};
-  disk_sector_t block_ctx [INDIRECT_BLOCK_SIZE] = {0}; 
+  disk_sector_t *slot, block, *entries;
 
-  int iter = 0; 
+  /* map by a direct block */
+  if (idx < DIRECT_PTR_NUM)
+  {
+    disk_inode->directory[idx] = sector;
+    disk_inode->direct_idx++;
+    return true;
+  }
 
-  while (sectors > 0 && iter < INDIRECT_BLOCK_SIZE)
+  /* map by a indirect block */
+  idx -= DIRECT_PTR_NUM;
+  if (idx < INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE)
   {
-    if (free_map_allocate (1, &block_ctx[iter]))
-    {
-      sectors--;
-      disk_write (filesys_disk, block_ctx[iter], zeros);
-    }
-    else
-      goto error;
+    slot = &disk_inode->directory[DIRECT_PTR_NUM + idx / INDIRECT_BLOCK_SIZE];
+    if (*slot == 0 && !allocate_block (sector, slot))
+      return false;
 
-    iter++;
+    pin_block (pb, *slot)[idx % INDIRECT_BLOCK_SIZE] = sector;
+    disk_inode->indirect_idx++;
+    return true;
   }
 
-  disk_write (filesys_disk, indirect_block, block_ctx);
+  /* map by a double indirect block */
+  idx -= INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE;
+  if (idx >= INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
+    return false;
 
-  return iter;
+  slot = &disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM];
+  if (*slot == 0 && !allocate_block (sector, slot))
+    return false;
 
-error:
-  /* dealloc indirect block */
-  while (iter >= 0)
+  block = indirect_entry (*slot, idx / INDIRECT_BLOCK_SIZE);
+  if (block == 0)
   {
-    free_map_release (block_ctx[iter], 1);
-    iter--;
+    if (!allocate_block (sector, &block))
+      return false;
+    entries = cache_get (*slot, true);
+    entries[idx / INDIRECT_BLOCK_SIZE] = block;
+    cache_put (entries, true);
   }
 
-  return ERROR_ALLOC;
+  pin_block (pb, block)[idx % INDIRECT_BLOCK_SIZE] = sector;
+  disk_inode->double_indirect_idx++;
+  return true;
 }
 
-/* allocate memory by a double indirect block */
-static int double_indirect_allocate (size_t sectors, disk_sector_t double_indirect_block)
+/* team10
+ * allocates every hole of DISK_INODE from sector index IDX up to END,
+ * in runs of consecutive sectors as long as the free map has them.
+ * a run goes right after the sector before it if that one is free, or
+ * else as close past it as possible, or past GOAL for the first sector.
+ * if ZERO is true, new sectors are zeroed in the buffer cache instead of
+ * on the disk, and each indirect block is pinned once while its entries
+ * are filled, so a growth does no synchronous write at all.
+ * sectors past the mapped ones of an extent list are appended to it.
+ * returns the number of sectors from IDX on that are mapped, which is
+ * less than END - IDX if the disk is full or the file reaches its
+ * largest size, leaving the sectors not allocated as holes */
+static size_t
+inode_fill (struct inode_disk *disk_inode, size_t idx, size_t end,
+	    disk_sector_t goal, bool zero)
 {
-  disk_sector_t block_ctx [INDIRECT_BLOCK_SIZE] = {0};
-
-  int iter = 0, ret = 0; 
-  size_t alloc_sectors;
+  struct pinned_block pb = {0, NULL};
+  size_t start = idx;
 
-  while (sectors > 0 && iter < INDIRECT_BLOCK_SIZE)
+  if (has_extents (disk_inode))
   {
-    alloc_sectors = sectors < INDIRECT_BLOCK_SIZE ? sectors : INDIRECT_BLOCK_SIZE;
+    struct extent_memo memo = {0, 0};
 
-    if (free_map_allocate (1, &block_ctx[iter]))
+    while (idx < end)
     {
-      int idx = indirect_allocate (alloc_sectors, block_ctx[iter]);
+      size_t cnt;
+      disk_sector_t sector = extent_lookup (&disk_inode->extents, idx,
+					    &memo, &cnt);
 
-      if (idx == ERROR_ALLOC)
-	goto error;
-      else
+      if (sector == (disk_sector_t) -1)
+	return idx - start
+	  + extent_grow (&disk_inode->extents, end - idx, goal, zero);
+
+      if (sector == 0)
       {
-	sectors -= idx;
-	ret += idx;
+	cnt = extent_fill (&disk_inode->extents, idx,
+			   cnt < end - idx ? cnt : end - idx, goal);
+	if (cnt == 0)
+	  return idx - start;
       }
+      idx += cnt;
     }
-    else 
-      goto error;
-
-    iter++;
+    return end - start;
   }
 
-  disk_write (filesys_disk, double_indirect_block, block_ctx);
+  while (idx < end)
+  {
+    disk_sector_t start, prev;
+    size_t cnt, i;
+
+    if (lookup_sector (disk_inode, idx) != 0)
+    {
+      idx++;
+      continue;
+    }
+
+    /* allocate the whole hole at once */
+    for (cnt = 1; idx + cnt < end && lookup_sector (disk_inode, idx + cnt) == 0; cnt++)
+      continue;
+    prev = idx > 0 ? lookup_sector (disk_inode, idx - 1) : 0;
+    cnt = free_map_allocate_run (prev != 0 ? prev + 1 : goal, cnt, &start);
+    if (cnt == 0)
+      break;
 
-  return ret;
+    /* zero a sector before mapping it, so a reader never sees its
+       old contents */
+    for (i = 0; i < cnt; i++, idx++)
+    {
+      if (zero)
+	cache_zero (start + i);
+      if (!set_sector (disk_inode, idx, start + i, &pb))
+      {
+	free_map_release (start + i, cnt - i);
+	goto done;
+      }
+    }
+  }
 
-error:
-  /* dealloc indirect block */
-  return ERROR_ALLOC;
+done:
+  unpin_block (&pb);
+  return (idx < end ? idx : end) - start;
 }
 
 /* deallocate all memory allocated by the disk_indoe */
 static void inode_deallocate (struct inode_disk *disk_inode)
 {
-  off_t idx, idx_max;
+  off_t idx;
 
-  /* deallocate direct blocks */
-  while (disk_inode->direct_idx > 0)
+  if (has_extents (disk_inode))
   {
-    free_map_release (disk_inode->directory[disk_inode->direct_idx - 1], 1);
-    disk_inode->direct_idx--;
+    extent_release (&disk_inode->extents);
+    return;
   }
 
+  /* deallocate direct blocks */
+  for (idx = 0; idx < DIRECT_PTR_NUM; idx++)
+    if (disk_inode->directory[idx] != 0)
+      free_map_release (disk_inode->directory[idx], 1);
+
   /* deallocate indirect blocks */
-  while (disk_inode->indirect_idx > 0)
-  {	
-    idx = (disk_inode->indirect_idx - 1) / INDIRECT_BLOCK_SIZE;
-    idx_max = (idx % INDIRECT_BLOCK_SIZE == 0) ? (idx > 0 ? INDIRECT_BLOCK_SIZE : 0) : idx % INDIRECT_BLOCK_SIZE;
-    indirect_deallocate (disk_inode->directory[idx + DIRECT_PTR_NUM], idx_max);
-    free_map_release (disk_inode->directory[idx + DIRECT_PTR_NUM], 1);
-    disk_inode->indirect_idx -= idx_max;
-  }
+  for (idx = 0; idx < INDIRECT_PTR_NUM; idx++)
+    if (disk_inode->directory[idx + DIRECT_PTR_NUM] != 0)
+      indirect_deallocate (disk_inode->directory[idx + DIRECT_PTR_NUM]);
 
   /* deallocate double indirect blocks */
-  if (disk_inode->double_indirect_idx > 0)
-  {
-    double_indirect_deallocate (disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM], (disk_inode->double_indirect_idx - 1) / INDIRECT_BLOCK_SIZE, disk_inode->double_indirect_idx);
-  }
+  if (disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM] != 0)
+    double_indirect_deallocate (disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM]);
+
+  memset (disk_inode->directory, 0, sizeof disk_inode->directory);
+  disk_inode->direct_idx = 0;
+  disk_inode->indirect_idx = 0;
+  disk_inode->double_indirect_idx = 0;
 }
 
-/* deallocate a indirect block memory */ 
-static void indirect_deallocate (disk_sector_t sector, size_t cnt)
+/* deallocate a indirect block and the sectors it maps, skipping holes */ 
+static void indirect_deallocate (disk_sector_t sector)
 {
   unsigned iter;
   disk_sector_t block[INDIRECT_BLOCK_SIZE];
 
-  disk_read (filesys_disk, sector, block);
+  read_cache (sector, block, DISK_SECTOR_SIZE, 0);
 
-  for (iter = 0; iter < cnt; iter++)
-    free_map_release (block[iter], 1);
+  for (iter = 0; iter < INDIRECT_BLOCK_SIZE; iter++)
+    if (block[iter] != 0)
+      free_map_release (block[iter], 1);
 
   free_map_release (sector, 1);
 }
 
-/* deallcate a double indirect block memeory 
- * sectors means the number of sectors allocated by a double indirect block */
-static void double_indirect_deallocate (disk_sector_t sector, size_t cnt, size_t sectors)
+/* deallcate a double indirect block memeory and every indirect block
+ * it points to */
+static void double_indirect_deallocate (disk_sector_t sector)
 {
   unsigned iter;
-  size_t block_sectors;
   disk_sector_t block[INDIRECT_BLOCK_SIZE];
 
-  disk_read (filesys_disk, sector, block);
+  read_cache (sector, block, DISK_SECTOR_SIZE, 0);
+
+  for (iter = 0; iter < INDIRECT_BLOCK_SIZE; iter++)
+    if (block[iter] != 0)
+      indirect_deallocate (block[iter]);
+
+  free_map_release (sector, 1);
+}
+
+/* zero sector index IDX of DISK_INODE in the buffer cache, unless it is
+ * in a hole or is covered whole by a write of the bytes from OFFSET up to
+ * LENGTH, which fills it before readers can see it.  sector indexes are
+ * looked up from MEMO on, and MEMO is updated */
+static void zero_unwritten (const struct inode_disk *disk_inode, size_t idx,
+			    off_t offset, off_t length,
+			    struct extent_memo *memo)
+{
+  disk_sector_t sector;
+
+  if ((off_t) idx * DISK_SECTOR_SIZE >= offset
+      && (off_t) (idx + 1) * DISK_SECTOR_SIZE <= length)
+    return;
 
-  for (iter = 0; iter < cnt; iter++)
+  sector = has_extents (disk_inode)
+    ? extent_lookup (&disk_inode->extents, idx, memo, NULL)
+    : lookup_sector (disk_inode, idx);
+  if (sector != 0 && sector != (disk_sector_t) -1)
+    cache_zero (sector);
+}
+
+/* expand the map of DISK_INODE, the inode at SECTOR, from
+ * disk_inode->length to length for a write starting at OFFSET.  the
+ * sectors between the old end and OFFSET are left as holes, only the
+ * sectors written to are allocated.
+ * sectors reserved by inode_reserve () are used first.
+ * a sector the write covers whole is not zeroed, readers do not see it
+ * before the write commits the new length, so only the first and the
+ * last sector written and reserved sectors before OFFSET are zeroed in
+ * the buffer cache.
+ * returns the new length, which is shorter than LENGTH if the file could
+ * not grow that much */
+static off_t expand_map (struct inode_disk *disk_inode, disk_sector_t sector,
+			 off_t offset, off_t length)
+{
+  size_t old_sectors = bytes_to_sectors (disk_inode->length);
+  size_t mapped = old_sectors + disk_inode->reserved_sectors;
+  size_t first = offset / DISK_SECTOR_SIZE;
+  size_t end = bytes_to_sectors (length);
+  struct extent_memo memo = {0, 0};
+  size_t idx;
+
+  if (first < old_sectors)
+    first = old_sectors;
+
+  if (!has_extents (disk_inode) && end > MAX_SECTOR_NUM)
   {
-    block_sectors = sectors < INDIRECT_BLOCK_SIZE ? sectors : INDIRECT_BLOCK_SIZE;
-    indirect_deallocate (block[iter], block_sectors);
-    sectors -= block_sectors;
+    end = MAX_SECTOR_NUM;
+    length = end * DISK_SECTOR_SIZE;
   }
 
-  free_map_release (sector, 1);
+  /* reserved sectors hold whatever the disk had */
+  for (idx = old_sectors; idx < end && idx < mapped; idx++)
+    zero_unwritten (disk_inode, idx, offset, length, &memo);
+  disk_inode->reserved_sectors = mapped > end ? mapped - end : 0;
+
+  if (end <= mapped)
+    return length;
+  if (first < mapped)
+    first = mapped;
+
+  if (has_extents (disk_inode))
+  {
+    size_t grown;
+
+    if (first > mapped
+	&& !extent_add_hole (&disk_inode->extents, first - mapped))
+      return mapped > old_sectors
+	? (off_t) mapped * DISK_SECTOR_SIZE : disk_inode->length;
+
+    grown = extent_grow (&disk_inode->extents, end - first, sector, false);
+    if (grown < end - first)
+    {
+      length = (first + grown) * DISK_SECTOR_SIZE;
+      end = first + grown;
+    }
+  }
+  else
+  {
+    /* the file ends before the first sector which cannot be allocated */
+    size_t filled = inode_fill (disk_inode, first, end, sector, false);
+
+    if (filled == 0)
+      return mapped > old_sectors
+	? (off_t) mapped * DISK_SECTOR_SIZE : disk_inode->length;
+    if (filled < end - first)
+    {
+      length = (first + filled) * DISK_SECTOR_SIZE;
+      end = first + filled;
+    }
+  }
+
+  /* the sectors in between are covered by the write */
+  memo.idx = 0;
+  memo.base = 0;
+  if (end > first)
+    zero_unwritten (disk_inode, first, offset, length, &memo);
+  if (end > first + 1)
+    zero_unwritten (disk_inode, end - 1, offset, length, &memo);
+  return length;
 }
 
-/* expand a file from disk_inode->length to length */
-static off_t expand_file (struct inode *inode, off_t length)
+/* expand INODE to LENGTH bytes, or as far as the disk allows, for a write
+ * starting at OFFSET.  the sectors are allocated and zeroed on a copy of
+ * the on-disk inode without the map lock, which readers of INODE thus
+ * never wait for while the disk is busy; the new sectors are past the
+ * length readers look up, and the lock is held only while the grown map
+ * and length are published.
+ * the growth lock of INODE must be held */
+static void expand_file (struct inode *inode, off_t offset, off_t length)
+{
+  struct inode_disk *grown = malloc (sizeof *grown);
+
+  if (grown == NULL)
+    return;
+
+  *grown = inode->data;
+  grown->length = expand_map (grown, inode->sector, offset, length);
+
+  rwlock_acquire_write (&inode->map_lock);
+  inode->data = *grown;
+  rwlock_release_write (&inode->map_lock);
+  free (grown);
+}
+
+/* Returns the most sectors appending CNT sectors to DISK_INODE
+   allocates: CNT, plus the indirect or extent blocks mapping them. */
+static size_t
+grow_needs (const struct inode_disk *disk_inode, size_t cnt)
+{
+  if (has_extents (disk_inode))
+    return cnt + extent_grow_blocks (cnt);
+
+  /* an indirect block for every INDIRECT_BLOCK_SIZE sectors, one more
+     if they start in the middle of one, and the double indirect block */
+  return cnt + DIV_ROUND_UP (cnt, INDIRECT_BLOCK_SIZE) + 2;
+}
+
+/* Grows INODE to LENGTH bytes for a write starting at OFFSET with
+   delayed sectors, reserving enough sectors in the free map to map
+   all of them later, or refusing if it cannot.
+   Only a regular file whose map ends at its last sector is delayed,
+   and only if the write leaves no hole.
+   The growth lock and the map lock of INODE must be held.
+   Returns false if the write has to allocate its sectors now. */
+static bool
+inode_delay (struct inode *inode, off_t offset, off_t length)
 {
   struct inode_disk *disk_inode = &inode->data;
-  disk_sector_t sectors = bytes_to_sectors (length) - bytes_to_sectors (inode->data.length);
-  disk_sector_t block[INDIRECT_BLOCK_SIZE] = {0};
-  static char zeros[DISK_SECTOR_SIZE] = {0};
+  size_t old_sectors = bytes_to_sectors (disk_inode->length);
+  size_t cnt = bytes_to_sectors (length) - old_sectors;
+  size_t needs;
+  bool success;
+
+  if (disk_inode->is_dir || disk_inode->is_inline
+      || disk_inode->reserved_sectors > 0
+      || (size_t) offset / DISK_SECTOR_SIZE > old_sectors
+      || inode->delay_cnt + cnt > DELAY_MAX
+      || (!has_extents (disk_inode)
+	  && old_sectors + cnt > MAX_SECTOR_NUM))
+    return false;
+
+  /* the inode on disk is written only by inode_resolve_delayed () */
+  if (cnt == 0)
+  {
+    if (inode->delay_cnt == 0)
+      return false;
+    disk_inode->length = length;
+    return true;
+  }
 
-  while (sectors > 0)
+  /* delayed sectors stay in the cache, a quarter of it at most */
+  needs = grow_needs (disk_inode, inode->delay_cnt + cnt);
+  lock_acquire (&delay_lock);
+  success = delayed_total + cnt <= buf_cache_size / 4
+    && free_map_reserve (needs - inode->delay_reserved);
+  if (success)
   {
-    /* expand using direct blocks */
-    if (disk_inode->direct_idx < DIRECT_PTR_NUM)
+    delayed_total += cnt;
+    inode->delay_reserved = needs;
+    if (inode->delay_cnt == 0)
     {
-      if (free_map_allocate (1, &disk_inode->directory[disk_inode->direct_idx]))
-      {
-	disk_write (filesys_disk, disk_inode->directory[disk_inode->direct_idx], zeros);
-	sectors--;
-	disk_inode->direct_idx++;
-      }
-      else 
-	goto error;
+      inode->delay_start = old_sectors;
+      inode->delay_base = next_delayed;
+      next_delayed += DELAY_MAX;
+      if (next_delayed > UINT32_MAX - DELAY_MAX)
+	next_delayed = CACHE_DELAYED_BASE;
     }
+  }
+  lock_release (&delay_lock);
 
-    /* expand using indirect blocks */
-    else if (disk_inode->indirect_idx < INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE)
+  if (success)
+  {
+    inode->delay_cnt += cnt;
+    disk_inode->length = length;
+  }
+  return success;
+}
+
+/* Allocates disk sectors to the delayed sectors of INODE, in as few
+   runs as the free map has, and moves their data in the buffer cache
+   over to the allocated sectors, where it is written back from.
+   The sectors come out of those reserved by inode_delay (), which no
+   other allocation can take, so every delayed sector gets one.
+   The growth lock and the map lock of INODE must be held. */
+static void
+inode_resolve_delayed (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  struct extent_memo memo = {0, 0};
+  size_t start = inode->delay_start;
+  size_t end = start + inode->delay_cnt;
+  size_t idx;
+  bool success;
+
+  if (inode->delay_cnt == 0)
+    return;
+
+  free_map_begin_reserved (inode->delay_reserved);
+  success = inode_fill (disk_inode, start, end, inode->sector, false)
+    == end - start;
+  free_map_end_reserved ();
+  if (!success)
+    PANIC ("no disk sector for a delayed sector of inode %u",
+	   (unsigned) inode->sector);
+
+  for (idx = start; idx < end; idx++)
+  {
+    disk_sector_t sector = has_extents (disk_inode)
+      ? extent_lookup (&disk_inode->extents, idx, &memo, NULL)
+      : lookup_sector (disk_inode, idx);
+
+    cache_rename (inode->delay_base + (idx - start), sector);
+  }
+
+  lock_acquire (&delay_lock);
+  delayed_total -= inode->delay_cnt;
+  lock_release (&delay_lock);
+  inode->delay_cnt = 0;
+  inode->delay_reserved = 0;
+
+  write_cache (inode->sector, disk_inode, DISK_SECTOR_SIZE, 0);
+}
+
+/* Throws away the delayed sectors of INODE, which is removed, and
+   gives back the free map space reserved for them. */
+static void
+inode_discard_delayed (struct inode *inode)
+{
+  size_t i;
+
+  if (inode->delay_cnt == 0)
+    return;
+
+  for (i = 0; i < inode->delay_cnt; i++)
+    cache_discard (inode->delay_base + i);
+  free_map_unreserve (inode->delay_reserved);
+
+  lock_acquire (&delay_lock);
+  delayed_total -= inode->delay_cnt;
+  lock_release (&delay_lock);
+  inode->delay_cnt = 0;
+  inode->delay_reserved = 0;
+}
+
+/* Copies SIZE bytes between BUFFER and offset OFS of the sector of
+   INODE that holds byte POS, which was a delayed sector when it was
+   looked up.  The map lock is held for reading meanwhile, so the
+   sector cannot move to its disk sector in the middle of the copy.
+   Copies from BUFFER into the sector if WRITE is true. */
+static void
+delayed_copy (struct inode *inode, off_t pos, void *buffer, int size,
+	      int ofs, bool write)
+{
+  disk_sector_t sector;
+
+  rwlock_acquire_read (&inode->map_lock);
+  sector = map_sector (inode, pos);
+  if (write)
+    write_cache (sector, buffer, size, ofs);
+  else
+    read_cache (sector, buffer, size, ofs);
+  rwlock_release_read (&inode->map_lock);
+}
+
+/* Gives disk sectors to the delayed sectors of every open inode, so
+   that the buffer cache can write them back. */
+void
+inode_flush_delayed (void)
+{
+  struct inode *batch[16];
+  struct hash_iterator i;
+  size_t cnt, k;
+
+  do
+  {
+    /* keep the inodes open while they are resolved */
+    cnt = 0;
+    lock_acquire (&open_inodes_lock);
+    hash_first (&i, &open_inodes);
+    while (cnt < sizeof batch / sizeof *batch && hash_next (&i))
     {
-      off_t block_idx = (disk_inode->indirect_idx - 1) / INDIRECT_BLOCK_SIZE;
-      off_t inblock_idx = (disk_inode->indirect_idx - 1) % INDIRECT_BLOCK_SIZE;
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
 
-      if (disk_inode->indirect_idx == 0)
+      if (inode->delay_cnt > 0)
       {
-	block_idx = -1;
-	inblock_idx = INDIRECT_BLOCK_SIZE - 1;
+	inode->open_cnt++;
+	batch[cnt++] = inode;
       }
+    }
+    lock_release (&open_inodes_lock);
 
-      if (inblock_idx == INDIRECT_BLOCK_SIZE - 1)
-      {
-	if (free_map_allocate (1, &disk_inode->directory[block_idx + DIRECT_PTR_NUM + 1]))
-	{
-	  if (free_map_allocate (1, &block[0]))
-	  {
-	    sectors--;
-	    disk_inode->indirect_idx++;
-	    disk_write (filesys_disk, block[0], zeros);
-	    disk_write (filesys_disk, disk_inode->directory[block_idx + DIRECT_PTR_NUM + 1], block);
-	    memset (block, 0, sizeof block);
-	  }
-	  else
-	    goto error;
-	}
-	else
-	  goto error;
-      }
-      else
-      {
-	disk_read (filesys_disk, disk_inode->directory[block_idx + DIRECT_PTR_NUM], block);
+    for (k = 0; k < cnt; k++)
+    {
+      lock_acquire (&batch[k]->growth_lock);
+      rwlock_acquire_write (&batch[k]->map_lock);
+      inode_resolve_delayed (batch[k]);
+      rwlock_release_write (&batch[k]->map_lock);
+      lock_release (&batch[k]->growth_lock);
+      inode_close (batch[k]);
+    }
+  }
+  while (cnt == sizeof batch / sizeof *batch);
+}
 
-	if (free_map_allocate (1, &block[inblock_idx + 1]))
-	{
-	  sectors--;
-	  disk_inode->indirect_idx++;
-	  disk_write (filesys_disk, block[inblock_idx + 1], zeros);
-	  disk_write (filesys_disk, disk_inode->directory[block_idx + DIRECT_PTR_NUM], block);
-	  memset (block, 0, sizeof block);
-	}
-	else
-	  goto error;
-      }
+/* Releases the sectors mapped from sector index IDX up to END of
+   DISK_INODE, whose data is mapped by direct and indirect blocks,
+   leaving holes.  Only the pointers are cleared, the counts of
+   mapped sectors are left to the caller.  The indirect blocks stay
+   until the file is deallocated. */
+static void
+unmap_sectors (struct inode_disk *disk_inode, size_t idx, size_t end)
+{
+  struct pinned_block pb = {0, NULL};
+
+  for (; idx < end; idx++)
+  {
+    disk_sector_t sector = lookup_sector (disk_inode, idx);
+    size_t i = idx - DIRECT_PTR_NUM;
+    disk_sector_t block;
+
+    if (sector == 0)
+      continue;
+    free_map_release (sector, 1);
+
+    if (idx < DIRECT_PTR_NUM)
+      disk_inode->directory[idx] = 0;
+    else if (i < INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE)
+    {
+      block = disk_inode->directory[DIRECT_PTR_NUM + i / INDIRECT_BLOCK_SIZE];
+      pin_block (&pb, block)[i % INDIRECT_BLOCK_SIZE] = 0;
     }
-    /* expand using double indirect blocks */
-    else if (disk_inode->double_indirect_idx < INDIRECT_BLOCK_SIZE * INDIRECT_BLOCK_SIZE)
+    else
     {
-	//printf ("double indirect block\n");
-      off_t inblock_idx = (disk_inode->double_indirect_idx - 1) % INDIRECT_BLOCK_SIZE;
-      off_t block_idx = (disk_inode->double_indirect_idx - 1) / INDIRECT_BLOCK_SIZE;
-      disk_sector_t double_block[INDIRECT_BLOCK_SIZE] = {0};
+      i -= INDIRECT_PTR_NUM * INDIRECT_BLOCK_SIZE;
+      block = indirect_entry
+	(disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM],
+	 i / INDIRECT_BLOCK_SIZE);
+      pin_block (&pb, block)[i % INDIRECT_BLOCK_SIZE] = 0;
+    }
+  }
+  unpin_block (&pb);
+}
 
-      if (disk_inode->double_indirect_idx == 0)
-      {
-	if (free_map_allocate (1, &disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM]))
-	{
-	  disk_write (filesys_disk, disk_inode->directory[DIRECT_PTR_NUM], zeros);
-	  block_idx = -1;
-	  inblock_idx = INDIRECT_BLOCK_SIZE - 1;
-	}
-	else
-	  goto error;
-      }
+/* Reserves sectors for INODE to grow up to LENGTH bytes without
+   allocating, taking runs of consecutive sectors where it can.
+   The reserved sectors are neither written nor counted in the
+   length of INODE; expand_file() zeroes them in the buffer cache
+   when the length grows over them.
+   Returns true if successful, false if LENGTH is over the largest
+   file or the disk is full, in which case nothing is reserved. */
+bool
+inode_reserve (struct inode *inode, off_t length)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t old_sectors, mapped, needs, end = bytes_to_sectors (length);
+  bool success = true;
+
+  if (length < 0 || inode->deny_write_cnt
+      || (!has_extents (disk_inode) && end > MAX_SECTOR_NUM))
+    return false;
 
-      disk_read (filesys_disk, disk_inode->directory[DIRECT_PTR_NUM + INDIRECT_PTR_NUM], double_block);
+  lock_acquire (&inode->growth_lock);
+  rwlock_acquire_write (&inode->map_lock);
+  inode_resolve_delayed (inode);
 
-      if (inblock_idx == INDIRECT_BLOCK_SIZE - 1)
+  /* reserved sectors follow the data sectors, an inline file needs
+     them only to grow past its inode */
+  if (disk_inode->is_inline && length > INLINE_DATA_MAX
+      && !inode_uninline (inode))
+  {
+    rwlock_release_write (&inode->map_lock);
+    lock_release (&inode->growth_lock);
+    return false;
+  }
+
+  old_sectors = bytes_to_sectors (disk_inode->length);
+  mapped = old_sectors + disk_inode->reserved_sectors;
+  if (!disk_inode->is_inline && end > mapped)
+  {
+    /* the free map promises every sector needed before any is taken,
+       so a disk too full fails here with nothing allocated */
+    needs = grow_needs (disk_inode, end - mapped);
+    success = free_map_reserve (needs);
+    if (success)
+    {
+      free_map_begin_reserved (needs);
+      if (has_extents (disk_inode))
       {
-	if (free_map_allocate (1, &double_block[block_idx + 1]))
-	{
-	  if (free_map_allocate (1, &block[0]))
-	  {
-	    sectors--;
-	    disk_inode->double_indirect_idx++;
-	    disk_write (filesys_disk, block[0], zeros);
-	    disk_write (filesys_disk, double_block[block_idx + 1], block);
-	    memset (block, 0, sizeof block);
-	  }
-	  else
-	    goto error;
-	}
-	else
-	  goto error;
+	size_t grown = extent_grow (&disk_inode->extents, end - mapped,
+				    inode->sector, false);
+
+	success = grown == end - mapped;
+	if (!success)
+	  extent_shrink (&disk_inode->extents, grown);
       }
       else
       {
-	disk_read (filesys_disk, double_block[block_idx], block);
+	off_t direct_idx = disk_inode->direct_idx;
+	off_t indirect_idx = disk_inode->indirect_idx;
+	off_t double_indirect_idx = disk_inode->double_indirect_idx;
 
-	if (free_map_allocate (1, &block[inblock_idx + 1]))
+	success = inode_fill (disk_inode, mapped, end, inode->sector, false)
+	  == end - mapped;
+	if (!success)
 	{
-	  sectors--;
-	  disk_inode->indirect_idx++;
-	  disk_write (filesys_disk, block[inblock_idx + 1], zeros);
-	  disk_write (filesys_disk, double_block[block_idx], block);
-	  memset (block, 0, sizeof block);
+	  unmap_sectors (disk_inode, mapped, end);
+	  disk_inode->direct_idx = direct_idx;
+	  disk_inode->indirect_idx = indirect_idx;
+	  disk_inode->double_indirect_idx = double_indirect_idx;
 	}
-	else
-	  goto error;
       }
-
+      free_map_end_reserved ();
     }
 
-    else
+    if (success)
     {
-      return length - sectors * DISK_SECTOR_SIZE;
+      disk_inode->reserved_sectors = end - old_sectors;
+      write_cache (inode->sector, disk_inode, DISK_SECTOR_SIZE, 0);
     }
-  }    
+  }
 
-  return length;
+  rwlock_release_write (&inode->map_lock);
+  lock_release (&inode->growth_lock);
+  return success;
+}
+
+/* Returns the hashed index of directory INODE, opened once more for
+   the caller to close, or a null pointer if it has none.
+   It is fetched from INODE every time, so an index made or dropped
+   through another opener of the directory is seen at once. */
+struct inode *
+inode_open_dir_index (struct inode *inode)
+{
+  struct inode *index;
+
+  ASSERT (inode->data.is_dir);
+
+  lock_acquire (&inode->growth_lock);
+  if (inode->dir_index == NULL && inode->data.dir_index != 0)
+    inode->dir_index = inode_open (inode->data.dir_index);
+  index = inode_reopen (inode->dir_index);
+  lock_release (&inode->growth_lock);
+  return index;
+}
+
+/* Makes INDEX the hashed index of directory INODE, or leaves INODE
+   without one if INDEX is null.  The inode lock of the directory
+   must be held. */
+void
+inode_set_dir_index (struct inode *inode, struct inode *index)
+{
+  struct inode *old;
+
+  ASSERT (inode->data.is_dir);
+  ASSERT (lock_held_by_current_thread (&inode->dir_lock));
+
+  lock_acquire (&inode->growth_lock);
+  old = inode->dir_index;
+  inode->dir_index = inode_reopen (index);
+  inode->data.dir_index = index != NULL ? index->sector : 0;
+  write_cache (inode->sector, &inode->data, DISK_SECTOR_SIZE, 0);
+  lock_release (&inode->growth_lock);
+  inode_close (old);
+}
+
+/* Locks directory INODE, so that one thread at a time changes its
+   entries and its hashed index. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  ASSERT (inode->data.is_dir);
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Unlocks directory INODE, locked by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
+/* Returns true if the inode at SECTOR maps its data by extents,
+   which tells the layout chosen when the disk was formatted. */
+bool
+inode_has_extents (disk_sector_t sector)
+{
+  struct inode_disk disk_inode;
 
-error:
-  return length - sectors * DISK_SECTOR_SIZE;
+  read_cache (sector, &disk_inode, DISK_SECTOR_SIZE, 0);
+  return has_extents (&disk_inode);
 }
 
 bool
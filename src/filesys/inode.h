@@ -7,7 +7,10 @@
 
 struct bitmap;
 
+extern bool inode_use_extents;
+
 void inode_init (void);
+void inode_print_stats (void);
 bool inode_create (disk_sector_t, off_t, bool);
 struct inode *inode_open (disk_sector_t);
 struct inode *inode_reopen (struct inode *);
@@ -16,10 +19,19 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+bool inode_reserve (struct inode *, off_t length);
+void inode_flush_delayed (void);
+const void *inode_get_block (struct inode *, off_t offset);
+void inode_put_block (const void *);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
 int inode_cnt (const struct inode *);
+bool inode_has_extents (disk_sector_t);
+struct inode *inode_open_dir_index (struct inode *);
+void inode_set_dir_index (struct inode *, struct inode *index);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 bool inode_is_dir (struct inode *);
 void set_parentdir (struct inode *current, struct inode *parent);
 struct inode *get_parentdir (struct inode *current);
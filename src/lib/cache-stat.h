@@ -0,0 +1,20 @@
+#ifndef __LIB_CACHE_STAT_H
+#define __LIB_CACHE_STAT_H
+
+/* Buffer cache statistics, as reported by the cachestat system
+   call.  Shared between the kernel and user programs. */
+struct cache_stat
+  {
+    long long hits;             /* Accesses to a cached sector. */
+    long long misses;           /* Accesses which loaded a sector. */
+    long long clean_evictions;  /* Clean caches evicted. */
+    long long dirty_evictions;  /* Dirty caches written back to evict. */
+    long long read_ahead_issued;/* Sectors loaded by read ahead. */
+    long long read_ahead_used;  /* ...and accessed afterwards. */
+    long long read_ahead_wasted;/* ...and evicted without an access. */
+    long long writebacks;       /* Sectors written back to disk. */
+    long long lock_waits;       /* Acquisitions of the cache lock that blocked. */
+    long long lock_wait_ticks;  /* Timer ticks spent blocked on it. */
+  };
+
+#endif /* lib/cache-stat.h */
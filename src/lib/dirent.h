@@ -0,0 +1,15 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+#include <stdbool.h>
+
+/* A directory entry, as reported by the getdents system call.
+   Shared between the kernel and user programs. */
+struct dirent
+  {
+    char name[14 + 1];          /* Null terminated file name. */
+    int inumber;                /* Sector of the file's inode. */
+    bool is_dir;                /* Whether the file is a directory. */
+  };
+
+#endif /* lib/dirent.h */
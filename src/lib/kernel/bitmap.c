@@ -21,13 +21,35 @@ typedef unsigned long elem_type;
 /* Number of bits in an element. */
 #define ELEM_BITS (sizeof (elem_type) * CHAR_BIT)
 
+/* Number of elements summarized together. */
+#define GROUP_ELEMS 8
+
+/* Number of bits in a group. */
+#define GROUP_BITS (GROUP_ELEMS * ELEM_BITS)
+
+/* Summary of a group of GROUP_BITS bits, which lets bitmap_scan()
+   take or skip a whole group without looking at its bits.
+   Changing a bit only marks its group stale, and the summary is
+   brought up to date by the next scan that needs it. */
+struct summary
+  {
+    bool stale;                 /* True if the counts below are out
+                                   of date. */
+    uint16_t set_cnt;           /* Number of bits set to true. */
+    uint16_t lead_free;         /* False bits at the start. */
+    uint16_t trail_free;        /* False bits at the end. */
+    uint16_t longest_free;      /* Longest run of false bits. */
+  };
+
 /* From the outside, a bitmap is an array of bits.  From the
    inside, it's an array of elem_type (defined above) that
-   simulates an array of bits. */
+   simulates an array of bits, with a summary of each group of
+   its elements on top. */
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    struct summary *summaries;  /* One per group of elements. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -60,6 +82,55 @@ byte_cnt (size_t bit_cnt)
   return sizeof (elem_type) * elem_cnt (bit_cnt);
 }
 
+/* Returns the mask of the bits of the element that holds bit
+   IDX which are at or after IDX and before END.  END must be past
+   IDX. */
+static inline elem_type
+range_mask (size_t idx, size_t end)
+{
+  elem_type mask = (elem_type) -1 << (idx % ELEM_BITS);
+  if (end - (idx - idx % ELEM_BITS) < ELEM_BITS)
+    mask &= ((elem_type) 1 << (end % ELEM_BITS)) - 1;
+  return mask;
+}
+
+/* Returns the index of the first bit of the element after the one
+   that holds bit IDX. */
+static inline size_t
+next_elem (size_t idx)
+{
+  return idx - idx % ELEM_BITS + ELEM_BITS;
+}
+
+/* Returns the number of bits set to 1 in E.
+   The kernel is not linked with libgcc, so this does the work of
+   __builtin_popcountl() itself, a few bits at a time in parallel. */
+static inline size_t
+count_ones (elem_type e)
+{
+  const elem_type ones = (elem_type) -1;
+
+  e = e - ((e >> 1) & (ones / 3));
+  e = (e & (ones / 15 * 3)) + ((e >> 2) & (ones / 15 * 3));
+  e = (e + (e >> 4)) & (ones / 255 * 15);
+  return (e * (ones / 255)) >> (sizeof (elem_type) - 1) * CHAR_BIT;
+}
+
+/* Returns the number of groups required for BIT_CNT bits. */
+static inline size_t
+group_cnt (size_t bit_cnt)
+{
+  return DIV_ROUND_UP (bit_cnt, GROUP_BITS);
+}
+
+/* Marks the summary of the group that contains the bit numbered
+   BIT_IDX as out of date. */
+static inline void
+mark_stale (const struct bitmap *b, size_t bit_idx)
+{
+  b->summaries[bit_idx / GROUP_BITS].stale = true;
+}
+
 /* Returns a bit mask in which the bits actually used in the last
    element of B's bits are set to 1 and the rest are set to 0. */
 static inline elem_type
@@ -83,11 +154,14 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
-      if (b->bits != NULL || bit_cnt == 0)
+      b->summaries = malloc (group_cnt (bit_cnt) * sizeof *b->summaries);
+      if ((b->bits != NULL && b->summaries != NULL) || bit_cnt == 0)
         {
           bitmap_set_all (b, false);
           return b;
         }
+      free (b->bits);
+      free (b->summaries);
       free (b);
     }
   return NULL;
@@ -105,6 +179,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->summaries = (struct summary *) ((uint8_t *) b->bits + byte_cnt (bit_cnt));
   bitmap_set_all (b, false);
   return b;
 }
@@ -114,7 +189,8 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 size_t
 bitmap_buf_size (size_t bit_cnt) 
 {
-  return sizeof (struct bitmap) + byte_cnt (bit_cnt);
+  return (sizeof (struct bitmap) + byte_cnt (bit_cnt)
+          + group_cnt (bit_cnt) * sizeof (struct summary));
 }
 
 /* Destroys bitmap B, freeing its storage.
@@ -126,6 +202,7 @@ bitmap_destroy (struct bitmap *b)
   if (b != NULL) 
     {
       free (b->bits);
+      free (b->summaries);
       free (b);
     }
 }
@@ -164,6 +241,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  mark_stale (b, bit_idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -177,6 +255,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  mark_stale (b, bit_idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -192,6 +271,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  mark_stale (b, bit_idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -214,18 +294,34 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is set at once, atomically as bitmap_mark() and
+   bitmap_reset() set a bit. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t end = start + cnt;
   size_t i;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  if (cnt == 0)
+    return;
+
+  for (i = start; i < end; i = next_elem (i))
+    {
+      elem_type mask = range_mask (i, end);
+
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[elem_idx (i)]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[elem_idx (i)]) : "r" (~mask) : "cc");
+    }
+
+  for (i = start / GROUP_BITS; i <= (end - 1) / GROUP_BITS; i++)
+    b->summaries[i].stale = true;
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -233,6 +329,7 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t end = start + cnt;
   size_t i, value_cnt;
 
   ASSERT (b != NULL);
@@ -240,9 +337,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (start + cnt <= b->bit_cnt);
 
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  for (i = start; i < end; i = next_elem (i))
+    {
+      elem_type e = b->bits[elem_idx (i)];
+      value_cnt += count_ones ((value ? e : ~e) & range_mask (i, end));
+    }
   return value_cnt;
 }
 
@@ -251,15 +350,19 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t end = start + cnt;
   size_t i;
   
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
+  for (i = start; i < end; i = next_elem (i))
+    {
+      elem_type e = b->bits[elem_idx (i)];
+      if (((value ? e : ~e) & range_mask (i, end)) != 0)
+        return true;
+    }
   return false;
 }
 
@@ -289,23 +392,154 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 
 /* Finding set or unset bits. */
 
+/* Returns the index of the first bit in B at or after START, and
+   before END, that is set to VALUE, or END if there is none. */
+static size_t
+find_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  size_t i;
+
+  for (i = start; i < end; i = next_elem (i))
+    {
+      elem_type e = b->bits[elem_idx (i)];
+
+      e = (value ? e : ~e) & range_mask (i, end);
+      if (e != 0)
+        return i - i % ELEM_BITS + __builtin_ctzl (e);
+    }
+  return end;
+}
+
+/* Returns the summary of group GROUP of B, bringing it up to
+   date first if it is stale. */
+static const struct summary *
+summarize (const struct bitmap *b, size_t group)
+{
+  struct summary *s = &b->summaries[group];
+
+  if (s->stale)
+    {
+      size_t start = group * GROUP_BITS;
+      size_t end = b->bit_cnt - start < GROUP_BITS ? b->bit_cnt : start + GROUP_BITS;
+      size_t i = start;
+
+      s->stale = false;
+      s->set_cnt = bitmap_count (b, start, end - start, true);
+      s->longest_free = 0;
+
+      /* Walk the runs of false bits, each up to the next true bit. */
+      for (;;)
+        {
+          size_t set = find_bit (b, i, end, true);
+
+          if (i == start)
+            s->lead_free = set - start;
+          if (set - i > s->longest_free)
+            s->longest_free = set - i;
+          if (set == end)
+            {
+              s->trail_free = set - i;
+              break;
+            }
+
+          i = find_bit (b, set, end, false);
+          if (i == end)
+            {
+              s->trail_free = 0;
+              break;
+            }
+        }
+    }
+  return s;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
+   Each group of elements that is reached at its first bit is
+   taken or skipped as a whole by its summary if it can be, so a
+   scan over full regions of B does not look at their bits.
    If there is no such group, returns BITMAP_ERROR. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
+  size_t i = start, run = 0, run_start = start;
+
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt == 0)
+    return start;
+
+  while (i < b->bit_cnt)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t group = i / GROUP_BITS;
+      size_t end = b->bit_cnt - i < GROUP_BITS ? b->bit_cnt : (group + 1) * GROUP_BITS;
+
+      if (i % GROUP_BITS == 0)
+        {
+          const struct summary *s = summarize (b, group);
+          size_t bits = end - i;
+          size_t same = value ? s->set_cnt : bits - s->set_cnt;
+
+          /* The run goes on through the whole group. */
+          if (same == bits)
+            {
+              if (run == 0)
+                run_start = i;
+              run += bits;
+              if (run >= cnt)
+                return run_start;
+              i = end;
+              continue;
+            }
+
+          /* The run ends at the start of the group. */
+          if (same == 0)
+            {
+              run = 0;
+              i = end;
+              continue;
+            }
+
+          /* Runs of false bits are known from the summary, so the
+             bits are looked at only to find one that is long
+             enough. */
+          if (!value)
+            {
+              if (run + s->lead_free >= cnt)
+                return run > 0 ? run_start : i;
+              if (s->longest_free < cnt)
+                {
+                  run = s->trail_free;
+                  run_start = end - run;
+                  i = end;
+                  continue;
+                }
+            }
+        }
+
+      /* Walk the runs of VALUE bits in the rest of the group. */
+      while (i < end)
+        {
+          size_t next = find_bit (b, i, end, value);
+
+          if (next != i)
+            {
+              run = 0;
+              i = next;
+              if (i == end)
+                break;
+            }
+          if (run == 0)
+            run_start = i;
+
+          next = find_bit (b, i, end, !value);
+          run += next - i;
+          if (run >= cnt)
+            return run_start;
+          i = next;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -345,8 +579,12 @@ bitmap_read (struct bitmap *b, struct file *file)
   if (b->bit_cnt > 0) 
     {
       off_t size = byte_cnt (b->bit_cnt);
+      size_t i;
+
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      for (i = 0; i < group_cnt (b->bit_cnt); i++)
+        b->summaries[i].stale = true;
     }
   return success;
 }
@@ -359,6 +597,29 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the elements of B that hold bits START through
+   START + CNT - 1 to FILE, at the offsets where bitmap_write()
+   puts them, so that FILE stays up to date after only those bits
+   changed.  Returns true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  off_t ofs, size;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+
+  ofs = elem_idx (start) * sizeof (elem_type);
+  size = (elem_idx (start + cnt - 1) + 1) * sizeof (elem_type) - ofs;
+  return file_write_at (file, (const uint8_t *) b->bits + ofs, size, ofs)
+         == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -182,3 +182,21 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cachestat (struct cache_stat *st)
+{
+  return syscall1 (SYS_CACHESTAT, st);
+}
+
+bool
+fallocate (int fd, unsigned length)
+{
+  return syscall2 (SYS_FALLOCATE, fd, length);
+}
+
+int
+getdents (int fd, struct dirent *buf, unsigned cnt)
+{
+  return syscall3 (SYS_GETDENTS, fd, buf, cnt);
+}
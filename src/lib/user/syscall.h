@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <cache-stat.h>
+#include <dirent.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -45,4 +47,9 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* File system extensions. */
+bool cachestat (struct cache_stat *);
+bool fallocate (int fd, unsigned length);
+int getdents (int fd, struct dirent *, unsigned cnt);
+
 #endif /* lib/user/syscall.h */
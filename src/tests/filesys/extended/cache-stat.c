@@ -0,0 +1,48 @@
+/* Checks that the buffer cache statistics reported by cachestat()
+   move as the file system is used: writing a file larger than
+   the buffer cache writes sectors back, and reading a sector
+   twice hits the cache. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Twice the default size of the buffer cache. */
+static char buf[128 * 512];
+
+void
+test_main (void) 
+{
+  struct cache_stat before, after;
+  char sector[512];
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("cached", 0), "create \"cached\"");
+  CHECK ((fd = open ("cached")) > 1, "open \"cached\"");
+
+  CHECK (cachestat (&before), "cachestat before writing");
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"cached\"");
+  CHECK (cachestat (&after), "cachestat after writing");
+  CHECK (after.writebacks > before.writebacks, "writebacks grew");
+  CHECK (after.hits + after.misses > before.hits + before.misses,
+         "accesses grew");
+
+  before = after;
+  msg ("read a sector of \"cached\" twice");
+  seek (fd, 0);
+  read (fd, sector, sizeof sector);
+  seek (fd, 0);
+  read (fd, sector, sizeof sector);
+  CHECK (cachestat (&after), "cachestat after reading");
+  CHECK (after.hits > before.hits, "hits grew");
+  CHECK (after.misses >= before.misses, "misses did not shrink");
+  CHECK (after.writebacks >= before.writebacks,
+         "writebacks did not shrink");
+
+  msg ("close \"cached\"");
+  close (fd);
+  check_file ("cached", buf, sizeof buf);
+}
@@ -0,0 +1,25 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stat) begin
+(cache-stat) create "cached"
+(cache-stat) open "cached"
+(cache-stat) cachestat before writing
+(cache-stat) write "cached"
+(cache-stat) cachestat after writing
+(cache-stat) writebacks grew
+(cache-stat) accesses grew
+(cache-stat) read a sector of "cached" twice
+(cache-stat) cachestat after reading
+(cache-stat) hits grew
+(cache-stat) misses did not shrink
+(cache-stat) writebacks did not shrink
+(cache-stat) close "cached"
+(cache-stat) open "cached" for verification
+(cache-stat) verified contents of "cached"
+(cache-stat) close "cached"
+(cache-stat) end
+EOF
+pass;
@@ -0,0 +1,46 @@
+/* Reserves space for a file with fallocate(), checks that its
+   size does not change, then fills the rest of the disk with
+   another file and checks that writing the reserved range still
+   succeeds. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[20000];
+
+void
+test_main (void) 
+{
+  char block[512];
+  int fd, filler;
+  size_t filled = 0;
+
+  random_bytes (buf, sizeof buf);
+  memset (block, 0, sizeof block);
+  CHECK (create ("reserved", 0), "create \"reserved\"");
+  CHECK ((fd = open ("reserved")) > 1, "open \"reserved\"");
+  CHECK (fallocate (fd, sizeof buf), "fallocate \"reserved\"");
+  CHECK (filesize (fd) == 0, "size of \"reserved\" is still 0");
+
+  CHECK (create ("filler", 0), "create \"filler\"");
+  CHECK ((filler = open ("filler")) > 1, "open \"filler\"");
+  msg ("fill the disk with \"filler\"");
+  while (write (filler, block, sizeof block) == (int) sizeof block)
+    filled += sizeof block;
+  if (filled == 0)
+    fail ("no room for \"filler\"");
+
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"reserved\"");
+  msg ("close \"reserved\"");
+  close (fd);
+  check_file ("reserved", buf, sizeof buf);
+
+  /* Leave room for the persistence test's tar archive. */
+  msg ("close \"filler\"");
+  close (filler);
+  CHECK (remove ("filler"), "remove \"filler\"");
+}
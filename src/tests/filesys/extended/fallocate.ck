@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fallocate) begin
+(fallocate) create "reserved"
+(fallocate) open "reserved"
+(fallocate) fallocate "reserved"
+(fallocate) size of "reserved" is still 0
+(fallocate) create "filler"
+(fallocate) open "filler"
+(fallocate) fill the disk with "filler"
+(fallocate) write "reserved"
+(fallocate) close "reserved"
+(fallocate) open "reserved" for verification
+(fallocate) verified contents of "reserved"
+(fallocate) close "reserved"
+(fallocate) close "filler"
+(fallocate) remove "filler"
+(fallocate) end
+EOF
+pass;
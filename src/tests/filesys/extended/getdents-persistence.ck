@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($tree);
+$tree->{'dir'}{"file$_"} = [''] foreach 0...49;
+$tree->{'dir'}{'sub'} = {};
+check_archive ($tree);
+pass;
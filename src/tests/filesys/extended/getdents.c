@@ -0,0 +1,98 @@
+/* Reads a directory larger than one getdents() buffer, in several
+   calls, and checks that every entry comes back exactly once with
+   the right type and inode number. */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 50
+
+/* FILE_CNT files and the subdirectory. */
+static bool seen[FILE_CNT + 1];
+
+/* Returns the index of NAME in SEEN, or -1 if it is not one of
+   the names created. */
+static int
+name_idx (const char *name)
+{
+  int i;
+
+  if (!strcmp (name, "sub"))
+    return FILE_CNT;
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char file_name[16];
+
+      snprintf (file_name, sizeof file_name, "file%d", i);
+      if (!strcmp (name, file_name))
+        return i;
+    }
+  return -1;
+}
+
+void
+test_main (void) 
+{
+  struct dirent entries[8];
+  int fd, i, cnt, calls = 0, total = 0;
+
+  CHECK (mkdir ("dir"), "mkdir \"dir\"");
+  msg ("create %d files in \"dir\"", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      char file_name[32];
+
+      snprintf (file_name, sizeof file_name, "dir/file%d", i);
+      if (!create (file_name, 0))
+        fail ("create \"%s\" failed", file_name);
+    }
+  CHECK (mkdir ("dir/sub"), "mkdir \"dir/sub\"");
+
+  CHECK ((fd = open ("dir")) > 1, "open \"dir\"");
+  msg ("read \"dir\" with getdents");
+  while ((cnt = getdents (fd, entries, sizeof entries / sizeof *entries)) > 0)
+    {
+      calls++;
+      for (i = 0; i < cnt; i++)
+        {
+          struct dirent *d = &entries[i];
+          char path[32];
+          int idx = name_idx (d->name), file_fd;
+
+          if (idx < 0)
+            fail ("unexpected entry \"%s\"", d->name);
+          if (seen[idx])
+            fail ("entry \"%s\" returned twice", d->name);
+          seen[idx] = true;
+          total++;
+
+          if (d->is_dir != (idx == FILE_CNT))
+            fail ("wrong type for \"%s\"", d->name);
+
+          if (idx == FILE_CNT)
+            strlcpy (path, "dir/sub", sizeof path);
+          else
+            snprintf (path, sizeof path, "dir/file%d", idx);
+          file_fd = open (path);
+          if (file_fd < 2)
+            fail ("open \"%s\" failed", path);
+          if (inumber (file_fd) != d->inumber)
+            fail ("wrong inode number for \"%s\"", d->name);
+          close (file_fd);
+        }
+    }
+  if (cnt < 0)
+    fail ("getdents failed");
+  if (total != FILE_CNT + 1)
+    fail ("getdents returned %d entries, expected %d",
+          total, FILE_CNT + 1);
+  if (calls < 2)
+    fail ("getdents returned all entries in one call");
+  msg ("every entry returned once");
+  msg ("close \"dir\"");
+  close (fd);
+}
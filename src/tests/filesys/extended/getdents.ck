@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(getdents) begin
+(getdents) mkdir "dir"
+(getdents) create 50 files in "dir"
+(getdents) mkdir "dir/sub"
+(getdents) open "dir"
+(getdents) read "dir" with getdents
+(getdents) every entry returned once
+(getdents) close "dir"
+(getdents) end
+EOF
+pass;
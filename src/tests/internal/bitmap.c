@@ -0,0 +1,164 @@
+/* Test program and microbenchmark for lib/kernel/bitmap.c.
+
+   Checks the counting, testing, setting and scanning functions,
+   which work on whole elements at a time, against bit-by-bit
+   versions built on bitmap_test(), then times them on a bitmap
+   as large as the free map of a big disk.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/test.h"
+
+/* Largest bitmap checked against the bit-by-bit versions. */
+#define MAX_BITS 1024
+
+/* Size of the bitmap timed by the benchmark, one bit per sector
+   of a 512 MB disk. */
+#define BENCH_BITS (1024 * 1024)
+
+/* Number of calls timed for each function. */
+#define BENCH_CALLS 1000
+
+static void verify (size_t bit_cnt);
+static size_t slow_count (const struct bitmap *, size_t, size_t, bool);
+static size_t slow_scan (const struct bitmap *, size_t, size_t, bool);
+static void benchmark (void);
+
+/* Test the bitmap implementation. */
+void
+test (void)
+{
+  size_t bit_cnt;
+
+  printf ("testing various size bitmaps:");
+  for (bit_cnt = 1; bit_cnt <= MAX_BITS; bit_cnt = bit_cnt * 3 / 2 + 1)
+    {
+      printf (" %zu", bit_cnt);
+      verify (bit_cnt);
+    }
+  printf (" done\n");
+
+  benchmark ();
+  printf ("bitmap: PASS\n");
+}
+
+/* Fills a bitmap of BIT_CNT bits at random, at several densities,
+   and checks the bitmap functions against the slow versions. */
+static void
+verify (size_t bit_cnt)
+{
+  struct bitmap *b = bitmap_create (bit_cnt);
+  int density;
+
+  ASSERT (b != NULL);
+  for (density = 0; density <= 100; density += 25)
+    {
+      int repeat;
+      size_t i;
+
+      for (i = 0; i < bit_cnt; i++)
+        bitmap_set (b, i, (int) (random_ulong () % 100) < density);
+
+      for (repeat = 0; repeat < 32; repeat++)
+        {
+          size_t start = random_ulong () % (bit_cnt + 1);
+          size_t cnt = random_ulong () % (bit_cnt - start + 1);
+          bool value = random_ulong () % 2;
+          size_t want = slow_scan (b, start, cnt % 64, value);
+
+          ASSERT (bitmap_count (b, start, cnt, value)
+                  == slow_count (b, start, cnt, value));
+          ASSERT (bitmap_contains (b, start, cnt, value)
+                  == (slow_count (b, start, cnt, value) > 0));
+          ASSERT (bitmap_scan (b, start, cnt % 64, value) == want);
+
+          /* Flip a random range, and the bits around it must stay. */
+          if (cnt > 0)
+            {
+              bool before = start > 0 && bitmap_test (b, start - 1);
+              bool after = start + cnt < bit_cnt && bitmap_test (b, start + cnt);
+
+              bitmap_set_multiple (b, start, cnt, value);
+              ASSERT (bitmap_count (b, start, cnt, value) == cnt);
+              ASSERT (start == 0 || bitmap_test (b, start - 1) == before);
+              ASSERT (start + cnt == bit_cnt
+                      || bitmap_test (b, start + cnt) == after);
+            }
+        }
+    }
+  bitmap_destroy (b);
+}
+
+/* Returns the number of bits in B between START and START + CNT,
+   exclusive, that are set to VALUE, one bit at a time. */
+static size_t
+slow_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, value_cnt = 0;
+
+  for (i = start; i < start + cnt; i++)
+    if (bitmap_test (b, i) == value)
+      value_cnt++;
+  return value_cnt;
+}
+
+/* Returns the start of the first run of CNT bits set to VALUE in B
+   at or after START, one bit at a time, or BITMAP_ERROR. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i;
+
+  for (i = start; i + cnt <= bitmap_size (b); i++)
+    if (slow_count (b, i, cnt, value) == cnt)
+      return i;
+  return BITMAP_ERROR;
+}
+
+/* Times the bitmap functions on a bitmap of BENCH_BITS bits which
+   is full but for its last few bits, the worst case of an
+   allocation on a nearly full disk. */
+static void
+benchmark (void)
+{
+  struct bitmap *b = bitmap_create (BENCH_BITS);
+  int64_t start;
+  size_t found = 0;
+  int i;
+
+  ASSERT (b != NULL);
+  bitmap_set_all (b, true);
+  bitmap_set_multiple (b, BENCH_BITS - 64, 16, false);
+
+  start = timer_ticks ();
+  for (i = 0; i < BENCH_CALLS; i++)
+    found += bitmap_count (b, 0, BENCH_BITS, false);
+  printf ("bitmap_count: %d calls in %lld ticks\n",
+          BENCH_CALLS, timer_elapsed (start));
+  ASSERT (found == 16 * BENCH_CALLS);
+
+  start = timer_ticks ();
+  for (i = 0; i < BENCH_CALLS; i++)
+    {
+      bitmap_set_multiple (b, i, BENCH_BITS / 2, false);
+      bitmap_set_multiple (b, i, BENCH_BITS / 2, true);
+    }
+  printf ("bitmap_set_multiple: %d calls in %lld ticks\n",
+          2 * BENCH_CALLS, timer_elapsed (start));
+
+  start = timer_ticks ();
+  for (i = 0; i < BENCH_CALLS; i++)
+    ASSERT (bitmap_scan (b, 0, 8, false) == BENCH_BITS - 64);
+  printf ("bitmap_scan: %d calls in %lld ticks\n",
+          BENCH_CALLS, timer_elapsed (start));
+
+  bitmap_destroy (b);
+}
@@ -34,6 +34,8 @@
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #include "filesys/cache.h"
+#include "filesys/inode.h"
+#include "filesys/dcache.h"
 #endif
 
 /* Amount of physical memory, in 4 kB pages. */
@@ -243,6 +245,18 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-cache"))
+        {
+          if (value == NULL || *value == '\0'
+              || value[strspn (value, "0123456789")] != '\0')
+            PANIC ("-cache requires a number of sectors");
+          buf_cache_size = atoi (value);
+          if (buf_cache_size < BUF_CACHE_MIN)
+            PANIC ("-cache=%s is below the minimum of %d sectors",
+                   value, BUF_CACHE_MIN);
+        }
+      else if (!strcmp (name, "-extents"))
+        inode_use_extents = true;
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
@@ -355,6 +369,10 @@ usage (void)
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef FILESYS
+          "  -cache=SECTORS     Cache SECTORS disk sectors (default 64, at least 8).\n"
+          "  -extents           Format with extent-based inodes (with -f).\n"
 #endif
           );
   power_off ();
@@ -393,6 +411,9 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   disk_print_stats ();
+  cache_print_stats ();
+  inode_print_stats ();
+  dcache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -19,6 +19,8 @@
 #include "lib/string.h"
 #include "filesys/inode.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
+#include <dirent.h>
 
 typedef int pid_t; //process ID
 #define FD_START 0 
@@ -56,6 +58,9 @@ static bool mkdir (const char *dir);
 static bool readdir (int fd, char *name);
 static bool isdir (int fd);
 static int inumber (int fd);
+static bool cachestat (struct cache_stat *st);
+static bool fallocate (int fd, unsigned length);
+static int getdents (int fd, struct dirent *buf, unsigned cnt);
 
 static int get_fd (void);
 static struct file_fd *find_fd (int fd);
@@ -79,7 +84,7 @@ syscall_handler (struct intr_frame *f)
   if (!pagedir_get_page (thread_current ()->pagedir, ptr))
     goto done;
 
-  if (*ptr < SYS_HALT || *ptr > SYS_INUMBER)
+  if (*ptr < SYS_HALT || *ptr > SYS_GETDENTS)
     goto done;
 
   switch (*ptr)
@@ -220,6 +225,32 @@ syscall_handler (struct intr_frame *f)
 		      f->eax = ret;
 		      break;
 		    }
+    case SYS_CACHESTAT:
+		    if (!is_user_vaddr (ptr + 1))
+		      goto done;
+		    else{
+		      bool ret = cachestat((struct cache_stat *)(*(ptr + 1)));
+		      f->eax = ret;
+		      break;
+		    }
+    case SYS_FALLOCATE:
+		    if (!is_user_vaddr (ptr + 1) || !is_user_vaddr (ptr + 2))
+		      goto done;
+		    else{
+		      bool ret = fallocate(*(ptr + 1), *(ptr + 2));
+		      f->eax = ret;
+		      break;
+		    }
+    case SYS_GETDENTS:
+		    if (!is_user_vaddr (ptr + 1) || !is_user_vaddr (ptr + 2)
+			|| !is_user_vaddr (ptr + 3))
+		      goto done;
+		    else{
+		      int ret = getdents(*(ptr + 1), (struct dirent *)(*(ptr + 2)),
+					 *(ptr + 3));
+		      f->eax = ret;
+		      break;
+		    }
   }
   return ;
 done:
@@ -647,6 +678,61 @@ static int inumber (int fd)
   return inode_get_inumber (file_get_inode (f_fd->file));
 }
 
+/* Copy buffer cache statistics into ST
+ * return true if successful, exit if ST is an invalid user buffer */
+static bool cachestat (struct cache_stat *st)
+{
+  if (st == NULL || !is_user_vaddr (st + 1)
+      || !pagedir_get_page (thread_current ()->pagedir, st)
+      || !pagedir_get_page (thread_current ()->pagedir, (char *) (st + 1) - 1))
+    exit (-1);
+
+  cache_get_stat (st);
+  return true;
+}
+
+/* Reserve disk space for the file of FD to grow up to LENGTH bytes
+ * return false if FD is not an open file or the disk is full */
+static bool fallocate (int fd, unsigned length)
+{
+  struct file_fd *f_fd = find_fd (fd);
+
+  /* a length an off_t cannot hold is past any file */
+  if (f_fd == NULL || f_fd->is_dir || f_fd->file == NULL
+      || length > INT32_MAX)
+    return false;
+
+  return file_allocate (f_fd->file, length);
+}
+
+/* Read up to CNT entries from directory given as FD into BUF
+ * return the number of entries read, 0 at the end of the directory
+ * or -1 if FD is not a directory, exit if BUF is an invalid user buffer */
+static int getdents (int fd, struct dirent *buf, unsigned cnt)
+{
+  struct file_fd *f_fd;
+  const char *page;
+
+  if (cnt == 0)
+    return 0;
+
+  /* every page BUF spans must be mapped, and BUF must end below
+     PHYS_BASE however large CNT is */
+  if (buf == NULL || !is_user_vaddr (buf)
+      || cnt > ((uintptr_t) PHYS_BASE - (uintptr_t) buf) / sizeof *buf)
+    exit (-1);
+  for (page = pg_round_down (buf); page < (const char *) (buf + cnt);
+       page += PGSIZE)
+    if (!pagedir_get_page (thread_current ()->pagedir, page))
+      exit (-1);
+
+  f_fd = find_fd (fd);
+  if (f_fd == NULL || !f_fd->is_dir || f_fd->dir == NULL)
+    return -1;
+
+  return dir_readdir_batch (f_fd->dir, buf, cnt);
+}
+
 /* find file descriptor structure with file descriptor */
 static struct file_fd *find_fd (int fd)
 {